@@ -106,5 +106,13 @@ void mips_usermode(struct trapframe *tf);
 extern vaddr_t cpustacks[];
 extern vaddr_t cputhreads[];
 
+/*
+ * Per-cpu range of stack pointers that mean the running kernel stack
+ * is about to overflow, and the stack to take the trap on instead
+ * (kstack option; see kstack.h).
+ */
+extern vaddr_t cpustackguards[][2];
+extern vaddr_t cpufaultstacks[];
+
 
 #endif /* _MIPS_TRAPFRAME_H_ */
@@ -110,11 +110,9 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
 	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
+	struct semaphore *ts_done;	/* V'd once the entry is gone */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -40,6 +40,11 @@
 #include <mainbus.h>
 #include <syscall.h>
 #include "opt-A3.h"
+#include "opt-kstack.h"
+
+#if OPT_KSTACK
+#include <kstack.h>
+#endif
 
 
 /* in exception.S */
@@ -152,6 +157,21 @@ mips_trap(struct trapframe *tf)
 
 	/* Make sure we haven't run off our stack */
 	if (curthread != NULL && curthread->t_stack != NULL) {
+#if OPT_KSTACK
+		/*
+		 * Running off a pooled stack hits its guard region, or
+		 * puts the trap frame on this cpu's fault stack if there
+		 * wasn't room for it (see exception.S).
+		 */
+		if (((code == EX_TLBL || code == EX_TLBS) &&
+		     kstack_isguard(tf->tf_vaddr)) ||
+		    (vaddr_t)tf < (vaddr_t)curthread->t_stack ||
+		    (vaddr_t)tf >= (vaddr_t)curthread->t_stack + STACK_SIZE) {
+			panic("Kernel stack overflow: sp 0x%x, epc 0x%x, "
+			      "vaddr 0x%x\n", tf->tf_sp, tf->tf_epc,
+			      tf->tf_vaddr);
+		}
+#endif
 		KASSERT((vaddr_t)tf > (vaddr_t)curthread->t_stack);
 		KASSERT((vaddr_t)tf < (vaddr_t)(curthread->t_stack
 						+ STACK_SIZE));
@@ -233,6 +253,14 @@ mips_trap(struct trapframe *tf)
 		goto done;
 	}
 
+#if OPT_KSTACK
+	/* Another thread's stack, not wired on this cpu? */
+	if (iskern && (code == EX_TLBL || code == EX_TLBS) &&
+	    kstack_fault(tf->tf_vaddr)) {
+		goto done;
+	}
+#endif
+
 	/*
 	 * Ok, it wasn't any of the really easy cases.
 	 * Call vm_fault on the TLB exceptions.
@@ -352,7 +380,8 @@ mips_trap(struct trapframe *tf)
 	 * kernel will (most likely) hang the system, so it's better
 	 * to find out now.
 	 */
-	KASSERT(SAME_STACK(cpustacks[curcpu->c_number]-1, (vaddr_t)tf));
+	KASSERT((vaddr_t)tf >= cpustacks[curcpu->c_number] - STACK_SIZE &&
+		(vaddr_t)tf < cpustacks[curcpu->c_number]);
 }
 
 /*
@@ -403,7 +432,8 @@ mips_usermode(struct trapframe *tf)
 	 * either another thread's stack or in the kernel heap.
 	 * (Exercise: why?)
 	 */
-	KASSERT(SAME_STACK(cpustacks[curcpu->c_number]-1, (vaddr_t)tf));
+	KASSERT((vaddr_t)tf >= cpustacks[curcpu->c_number] - STACK_SIZE &&
+		(vaddr_t)tf < cpustacks[curcpu->c_number]);
 
 	/*
 	 * This actually does it. See exception.S.
@@ -35,7 +35,9 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <copyinout.h>
 #include "opt-A2.h"
+#include "opt-vm.h"
 
 
 /*
@@ -82,6 +84,10 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+#if OPT_VM
+	int mmap_fd;
+	off_t mmap_offset;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -109,6 +115,11 @@ syscall(struct trapframe *tf)
 		err = sys___time((userptr_t)tf->tf_a0,
 				 (userptr_t)tf->tf_a1);
 		break;
+
+	    case SYS_nanosleep:
+		err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
 #ifdef UW
 	case SYS_write:
 	  err = sys_write((int)tf->tf_a0,
@@ -136,6 +147,34 @@ syscall(struct trapframe *tf)
 			    (int)tf->tf_a2,
 			    (pid_t *)&retval);
 	  break;
+	case SYS_setaffinity:
+	  err = sys_setaffinity((unsigned)tf->tf_a0);
+	  break;
+#if OPT_VM
+	case SYS_sbrk:
+	  err = sys_sbrk((int)tf->tf_a0, (vaddr_t *)&retval);
+	  break;
+	case SYS_mmap:
+	  /* fd and the (aligned) 64-bit offset are on the stack. */
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16), &mmap_fd,
+		       sizeof(mmap_fd));
+	  if (err == 0) {
+	    err = copyin((const_userptr_t)(tf->tf_sp + 24), &mmap_offset,
+			 sizeof(mmap_offset));
+	  }
+	  if (err == 0) {
+	    err = sys_mmap((userptr_t)tf->tf_a0,
+			   (size_t)tf->tf_a1,
+			   (int)tf->tf_a2,
+			   (int)tf->tf_a3,
+			   mmap_fd, mmap_offset,
+			   (vaddr_t *)&retval);
+	  }
+	  break;
+	case SYS_munmap:
+	  err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+	  break;
+#endif
 #endif // UW
 
 	    /* Add stuff here */
@@ -38,6 +38,7 @@
 #include <platform/maxcpus.h>
 #include <cpu.h>
 #include <thread.h>
+#include "opt-kstack.h"
 
 ////////////////////////////////////////////////////////////
 
@@ -59,6 +60,17 @@
 vaddr_t cpustacks[MAXCPUS];
 vaddr_t cputhreads[MAXCPUS];
 
+#if OPT_KSTACK
+/*
+ * Guard check on trap entry from the kernel (kstack option): if the
+ * old stack pointer is in [cpustackguards[n][0], cpustackguards[n][1]),
+ * the trap frame goes on cpufaultstacks[n] instead. Set by
+ * kstack_activate; both 0 while running on an unpooled stack.
+ */
+vaddr_t cpustackguards[MAXCPUS][2];
+vaddr_t cpufaultstacks[MAXCPUS];
+#endif
+
 /*
  * Do machine-dependent initialization of the cpu structure or things
  * associated with a new cpu. Note that we're not running on the new
@@ -88,6 +100,14 @@ cpu_machdep_init(struct cpu *c)
 		cpustacks[c->c_number] = stackpointer;
 		cputhreads[c->c_number] = (vaddr_t)c->c_curthread;
 	}
+
+#if OPT_KSTACK
+	stackpointer = (vaddr_t)kmalloc(STACK_SIZE);
+	if (stackpointer == 0) {
+		panic("cpu_machdep_init: couldn't allocate fault stack\n");
+	}
+	cpufaultstacks[c->c_number] = stackpointer + STACK_SIZE;
+#endif
 }
 
 ////////////////////////////////////////////////////////////
@@ -73,6 +73,23 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Restart the c0_count register from zero, so the next timer interrupt
+ * is a full c0_compare cycles away.
+ */
+static
+void
+mips_timer_restart(void)
+{
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mtc0 $0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		);
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -242,6 +259,24 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
+/*
+ * Tickless idle. The on-chip timer can't be switched off, so push the
+ * next tick as far away as it goes (about three minutes at 25 MHz).
+ */
+void
+mainbus_hardclock_stop(void)
+{
+	mips_timer_restart();
+	mips_timer_set(0xffffffff);
+}
+
+void
+mainbus_hardclock_start(void)
+{
+	mips_timer_restart();
+	mips_timer_set(CPU_FREQUENCY / HZ);
+}
+
 /*
  * Interrupt dispatcher.
  */
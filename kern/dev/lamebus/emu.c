@@ -52,6 +52,8 @@
 #include <platform/bus.h>
 #include <vfs.h>
 #include <emufs.h>
+#include <pagecache.h>
+#include "opt-vm.h"
 #include "autoconf.h"
 
 /* Register offsets */
@@ -479,11 +481,17 @@ emufs_reclaim(struct vnode *v)
 	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
-	if (ev->ev_v.vn_refcount != 1) {
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount>1);
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
@@ -705,8 +713,13 @@ static
 int
 emufs_fsync(struct vnode *v)
 {
+#if OPT_VM
+	/* The host file has no buffers of ours, but mapped pages might. */
+	return pagecache_flush(v);
+#else
 	(void)v;
 	return 0;
+#endif
 }
 
 /*
@@ -842,8 +855,9 @@ static
 int
 emufs_mmap(struct vnode *v)
 {
+	/* Files only; see emufs_dirops. */
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 //////////////////////////////
@@ -82,17 +82,16 @@ config_ltimer(struct ltimer_softc *lt, int ltimerno)
 
 	/*
 	 * We do, however, use ltimer for the timer clock, since the
-	 * on-chip timer can't do that.
+	 * on-chip timer can't do that. It is a one-shot alarm that
+	 * timerclock() reprograms each time it goes off.
 	 */
 	if (!havetimerclock) {
 		havetimerclock = true;
 		lt->lt_timerclock = 1;
 
-		/* Wire it to go off once every 10 ms */
-		/* KMS: reduced this from 1s to 10ms */
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 1);
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT,
-				   LT_GRANULARITY);
+		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 0);
+		timerclock_attach(lt, ltimer_setalarm);
+		ltimer_setalarm(lt, LT_GRANULARITY);
 	}
 	
 	return 0;
@@ -125,6 +124,18 @@ ltimer_irq(void *vlt)
 	}
 }
 
+/*
+ * Make the countdown timer interrupt once, USECS from now. This is
+ * called by the timeout code in clock.c.
+ */
+void
+ltimer_setalarm(void *vlt, uint32_t usecs)
+{
+	struct ltimer_softc *lt = vlt;
+
+	bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT, usecs);
+}
+
 /*
  * The timer device will beep if you write to the beep register. It
  * doesn't matter what value you write. This function is called if
@@ -44,12 +44,14 @@ struct ltimer_softc {
 	
 };
 
-/* Granularity of countdown timer (usec) */
+/* Granularity of clocknap() ticks (usec) */
 /* Should be less than 1000000 */
 #define LT_GRANULARITY   10000
 
 /* Functions called by lower-level drivers */
 void ltimer_irq(/*struct ltimer_softc*/ void *lt);  // interrupt handler
+void ltimer_setalarm(/*struct ltimer_softc*/ void *lt,
+		     uint32_t usecs);                    // for timerclock
 
 /* Functions called by higher-level devices */
 void ltimer_beep(/*struct ltimer_softc*/ void *devdata);   // for beep device
@@ -31,6 +31,12 @@
  * SFS filesystem
  *
  * File-level (vnode) interface routines.
+ *
+ * Locking: see sfs.h for the lock order. Vnode ops take the sv_lock
+ * of the vnodes they touch; the internal routines below expect the
+ * caller to hold it already. sfs_loadvnode and sfs_reclaim take
+ * sfs_vnlock themselves, and sfs_balloc and sfs_bfree take
+ * sfs_freemaplock.
  */
 #include <types.h>
 #include <kern/errno.h>
@@ -44,6 +50,8 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <pagecache.h>
+#include "opt-vm.h"
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
@@ -92,17 +100,20 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
 	}
 
-	/* Clear block before returning it */
+	/* Clear block before returning it. It's ours; no lock needed. */
 	return sfs_clearblock(sfs, *diskblock);
 }
 
@@ -113,12 +124,19 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
  * Check if a block is in use.
+ *
+ * This is only used for sanity checks on blocks the caller's inode
+ * (or the vnode table, for inode blocks) points to. Such a block can
+ * only be freed by someone holding the lock the caller holds, so its
+ * bit can't change under us and we can look without sfs_freemaplock.
  */
 static
 int
@@ -146,14 +164,8 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	/* I/O buffer for handling indirect blocks */
+	uint32_t *idbuf;
 
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	uint32_t block;
@@ -161,7 +173,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB*sizeof(uint32_t)==SFS_BLOCKSIZE);
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -229,7 +241,17 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		*diskblock = 0;
 		return 0;
 	}
-	else if (idblock==0) {
+
+	/*
+	 * Get a buffer for it. This used to be a static area, which
+	 * only worked because everything ran under one big lock.
+	 */
+	idbuf = kmalloc(SFS_BLOCKSIZE);
+	if (idbuf == NULL) {
+		return ENOMEM;
+	}
+
+	if (idblock==0) {
 		/*
 		 * There's no indirect block allocated, but we need to
 		 * allocate a block whose number needs to be stored in
@@ -238,6 +260,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 */
 		result = sfs_balloc(sfs, &idblock);
 		if (result) {
+			kfree(idbuf);
 			return result;
 		}
 
@@ -248,7 +271,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		sv->sv_dirty = true;
 
 		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		bzero(idbuf, SFS_BLOCKSIZE);
 	}
 	else {
 		/*
@@ -256,6 +279,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 */
 		result = sfs_rblock(sfs, idbuf, idblock);
 		if (result) {
+			kfree(idbuf);
 			return result;
 		}
 	}
@@ -267,6 +291,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	if (block==0 && doalloc) {
 		result = sfs_balloc(sfs, &block);
 		if (result) {
+			kfree(idbuf);
 			return result;
 		}
 
@@ -276,9 +301,11 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		/* The indirect block is now dirty; write it back */
 		result = sfs_wblock(sfs, idbuf, idblock);
 		if (result) {
+			kfree(idbuf);
 			return result;
 		}
 	}
+	kfree(idbuf);
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
@@ -289,6 +316,105 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	return 0;
 }
 
+/*
+ * Truncate a file to LEN bytes, freeing the blocks past the new end.
+ * Used by sfs_truncate and sfs_reclaim.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
+	/* I/O buffer for handling the indirect block */
+	uint32_t *idbuf;
+
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	/* Length in blocks (divide rounding up) */
+	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+
+	uint32_t i, j, block;
+	uint32_t idblock, baseblock, highblock;
+	int result;
+	int hasnonzero, iddirty;
+
+	/*
+	 * Go through the direct blocks. Discard any that are
+	 * past the limit we're truncating to.
+	 */
+	for (i=0; i<SFS_NDIRECT; i++) {
+		block = sv->sv_i.sfi_direct[i];
+		if (i >= blocklen && block != 0) {
+			sfs_bfree(sfs, block);
+			sv->sv_i.sfi_direct[i] = 0;
+			sv->sv_dirty = true;
+		}
+	}
+
+	/* Indirect block number */
+	idblock = sv->sv_i.sfi_indirect;
+
+	/* The lowest block in the indirect block */
+	baseblock = SFS_NDIRECT;
+
+	/* The highest block in the indirect block */
+	highblock = baseblock + SFS_DBPERIDB - 1;
+
+	if (blocklen < highblock && idblock != 0) {
+		/* We're past the proposed EOF; may need to free stuff */
+
+		idbuf = kmalloc(SFS_BLOCKSIZE);
+		if (idbuf == NULL) {
+			return ENOMEM;
+		}
+
+		/* Read the indirect block */
+		result = sfs_rblock(sfs, idbuf, idblock);
+		if (result) {
+			kfree(idbuf);
+			return result;
+		}
+		
+		hasnonzero = 0;
+		iddirty = 0;
+		for (j=0; j<SFS_DBPERIDB; j++) {
+			/* Discard any blocks that are past the new EOF */
+			if (blocklen < baseblock+j && idbuf[j] != 0) {
+				sfs_bfree(sfs, idbuf[j]);
+				idbuf[j] = 0;
+				iddirty = 1;
+			}
+			/* Remember if we see any nonzero blocks in here */
+			if (idbuf[j]!=0) {
+				hasnonzero=1;
+			}
+		}
+
+		if (!hasnonzero) {
+			/* The whole indirect block is empty now; free it */
+			sfs_bfree(sfs, idblock);
+			sv->sv_i.sfi_indirect = 0;
+			sv->sv_dirty = true;
+		}
+		else if (iddirty) {
+			/* The indirect block is dirty; write it back */
+			result = sfs_wblock(sfs, idbuf, idblock);
+			if (result) {
+				kfree(idbuf);
+				return result;
+			}
+		}
+		kfree(idbuf);
+	}
+
+	/* Set the file size */
+	sv->sv_i.sfi_size = len;
+
+	/* Mark the inode dirty */
+	sv->sv_dirty = true;
+
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
@@ -308,14 +434,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
+	/* I/O buffer for handling partial sectors */
+	char *iobuf;
 
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	uint32_t diskblock;
@@ -336,13 +456,18 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 		return result;
 	}
 
+	iobuf = kmalloc(SFS_BLOCKSIZE);
+	if (iobuf == NULL) {
+		return ENOMEM;
+	}
+
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
 		 * Zero the buffer.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		bzero(iobuf, SFS_BLOCKSIZE);
 	}
 	else {
 		/*
@@ -350,6 +475,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 		 */
 		result = sfs_rblock(sfs, iobuf, diskblock);
 		if (result) {
+			kfree(iobuf);
 			return result;
 		}
 	}
@@ -359,6 +485,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	 */
 	result = uiomove(iobuf+skipstart, len, uio);
 	if (result) {
+		kfree(iobuf);
 		return result;
 	}
 
@@ -368,10 +495,12 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (uio->uio_rw == UIO_WRITE) {
 		result = sfs_wblock(sfs, iobuf, diskblock);
 		if (result) {
+			kfree(iobuf);
 			return result;
 		}
 	}
 
+	kfree(iobuf);
 	return 0;
 }
 
@@ -893,37 +1022,56 @@ sfs_reclaim(struct vnode *v)
 	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
-	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * Write the inode back (erasing the file first if nothing on
+	 * disk refers to it) before taking sfs_vnlock, so lookups
+	 * don't wait behind the I/O. The vnode stays in the table
+	 * meanwhile, so anyone loading it gets this copy; if they
+	 * change it and let go before we get sfs_vnlock, it's dirty
+	 * again and we go around.
 	 */
-	if (v->vn_refcount != 1) {
+	while (1) {
+		rwlock_acquire_write(sv->sv_lock);
+		if (sv->sv_i.sfi_linkcount==0) {
+			result = sfs_dotruncate(sv, 0);
+			if (result) {
+				rwlock_release_write(sv->sv_lock);
+				return result;
+			}
+		}
+		result = sfs_sync_inode(sv);
+		rwlock_release_write(sv->sv_lock);
+		if (result) {
+			return result;
+		}
 
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
+		lock_acquire(sfs->sfs_vnlock);
 
-		vfs_biglock_release();
-		return EBUSY;
-	}
+		/*
+		 * Make sure someone else hasn't picked up the vnode
+		 * since the decision was made to reclaim it.
+		 * sfs_loadvnode only hands out references with
+		 * sfs_vnlock held, so once we hold it and see a count
+		 * of 1, nobody else can get at the vnode, and we don't
+		 * need sv_lock for the rest.
+		 */
+		spinlock_acquire(&v->vn_countlock);
+		if (v->vn_refcount != 1) {
 
-	/* If there are no on-disk references to the file either, erase it. */
-	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
-		if (result) {
-			vfs_biglock_release();
-			return result;
+			/* consume the reference VOP_DECREF gave us */
+			KASSERT(v->vn_refcount>1);
+			v->vn_refcount--;
+
+			spinlock_release(&v->vn_countlock);
+			lock_release(sfs->sfs_vnlock);
+			return EBUSY;
 		}
-	}
+		spinlock_release(&v->vn_countlock);
 
-	/* Sync the inode to disk */
-	result = sfs_sync_inode(sv);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+		if (!sv->sv_dirty) {
+			break;
+		}
+		lock_release(sfs->sfs_vnlock);
 	}
 
 	/* If there are no on-disk references, discard the inode */
@@ -950,15 +1098,85 @@ sfs_reclaim(struct vnode *v)
 
 	VOP_CLEANUP(&sv->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_vnlock);
 
 	/* Release the storage for the vnode structure itself. */
+	rwlock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
 	return 0;
 }
 
+/*
+ * Size of the kernel buffer user I/O goes through.
+ */
+#define SFS_BOUNCESIZE	(8 * SFS_BLOCKSIZE)
+
+/*
+ * Do I/O to or from user memory. A fault on the user buffer may read
+ * in a page of an executable (see vm_read_exec), taking that file's
+ * sv_lock, so we can't hold any sv_lock while touching user memory:
+ * copy through a kernel buffer instead, and lock around each chunk
+ * of file I/O only.
+ */
+static
+int
+sfs_userio(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	size_t len, got;
+	int result = 0;
+
+	buf = kmalloc(SFS_BOUNCESIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > SFS_BOUNCESIZE) {
+			len = SFS_BOUNCESIZE;
+		}
+		uio_kinit(&iov, &ku, buf, len, uio->uio_offset, uio->uio_rw);
+
+		if (uio->uio_rw == UIO_READ) {
+			rwlock_acquire_read(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			rwlock_release_read(sv->sv_lock);
+			if (result) {
+				break;
+			}
+			got = len - ku.uio_resid;
+			result = uiomove(buf, got, uio);
+			if (result || got < len) {
+				/* Fault, or EOF */
+				break;
+			}
+		}
+		else {
+			result = uiomove(buf, len, uio);
+			if (result) {
+				break;
+			}
+			rwlock_acquire_write(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			rwlock_release_write(sv->sv_lock);
+			if (result) {
+				/* Don't count what didn't reach the file. */
+				uio->uio_offset -= ku.uio_resid;
+				uio->uio_resid += ku.uio_resid;
+				break;
+			}
+		}
+	}
+
+	kfree(buf);
+	return result;
+}
+
 /*
  * Called for read(). sfs_io() does the work.
  */
@@ -971,9 +1189,13 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return sfs_userio(sv, uio);
+	}
+
+	rwlock_acquire_read(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_read(sv->sv_lock);
 
 	return result;
 }
@@ -990,9 +1212,13 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return sfs_userio(sv, uio);
+	}
+
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 
 	return result;
 }
@@ -1033,7 +1259,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	rwlock_acquire_read(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	rwlock_release_read(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +1281,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type is set when the vnode is loaded; no lock needed. */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1102,126 +1327,48 @@ sfs_fsync(struct vnode *v)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
-	vfs_biglock_acquire();
+#if OPT_VM
+	/* Mapped pages first; they go through sfs_write. */
+	result = pagecache_flush(v);
+	if (result) {
+		return result;
+	}
+#endif
+
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 
 	return result;
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Files can always be mapped; the VM system's page
+ * cache does the rest through sfs_read and sfs_write.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Called for ftruncate().
  */
 static
 int
 sfs_truncate(struct vnode *v, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_vnode *sv = v->vn_data;
-	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
-
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
-
-	/*
-	 * Go through the direct blocks. Discard any that are
-	 * past the limit we're truncating to.
-	 */
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = sv->sv_i.sfi_direct[i];
-		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block);
-			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
-		}
-	}
-
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
 
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
-	}
+	rwlock_acquire_write(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	rwlock_release_write(sv->sv_lock);
 
-	/* Set the file size */
-	sv->sv_i.sfi_size = len;
-
-	/* Mark the inode dirty */
-	sv->sv_dirty = true;
-
-	vfs_biglock_release();
-	return 0;
+	return result;
 }
 
 /*
@@ -1259,18 +1406,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -1278,18 +1425,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			rwlock_release_write(sv->sv_lock);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -1299,20 +1446,22 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		rwlock_release_write(sv->sv_lock);
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	rwlock_acquire_write(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	rwlock_release_write(newguy->sv_lock);
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return 0;
 }
 
@@ -1331,20 +1480,27 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/* No links to directories (this would also lock DIR twice) */
+	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
+		return EISDIR;
+	}
+
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	rwlock_acquire_write(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	rwlock_release_write(f->sv_lock);
 
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return 0;
 }
 
@@ -1360,28 +1516,38 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
+	/* Directories can't be removed (this would also lock DIR twice) */
+	if (victim->sv_i.sfi_type == SFS_TYPE_DIR) {
+		rwlock_release_write(sv->sv_lock);
+		VOP_DECREF(&victim->sv_v);
+		return EISDIR;
+	}
+
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		rwlock_acquire_write(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		rwlock_release_write(victim->sv_lock);
 	}
 
+	rwlock_release_write(sv->sv_lock);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1401,15 +1567,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	rwlock_acquire_write(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -1430,8 +1596,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	rwlock_acquire_write(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	rwlock_release_write(g1->sv_lock);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1443,14 +1611,17 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	rwlock_acquire_write(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	rwlock_release_write(g1->sv_lock);
+
+	rwlock_release_write(sv->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -1464,11 +1635,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	rwlock_acquire_write(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	rwlock_release_write(g1->sv_lock);
  puke:
+	rwlock_release_write(sv->sv_lock);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1486,15 +1659,13 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
+	/* Nothing here changes once the vnode is loaded; no lock needed. */
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +1673,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +1690,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
-	
+
+	rwlock_acquire_read(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	rwlock_release_read(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1645,6 +1812,10 @@ static const struct vnode_ops sfs_dirops = {
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
+ *
+ * sfs_vnlock is held throughout, including while reading the inode,
+ * so that two threads can't load the same inode twice and sfs_reclaim
+ * can't throw away a vnode we're handing out.
  */
 static
 int
@@ -1657,6 +1828,8 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	unsigned i, num;
 	int result;
 
+	lock_acquire(sfs->sfs_vnlock);
+
 	/* Look in the vnodes table */
 	num = vnodearray_num(sfs->sfs_vnodes);
 
@@ -1678,6 +1851,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
 			VOP_INCREF(&sv->sv_v);
+			lock_release(sfs->sfs_vnlock);
 			*ret = sv;
 			return 0;
 		}
@@ -1687,6 +1861,14 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_lock = rwlock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1699,7 +1881,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
+		rwlock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -1736,7 +1920,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		rwlock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -1747,10 +1933,14 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
+		rwlock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
@@ -1767,14 +1957,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
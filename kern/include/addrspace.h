@@ -36,9 +36,14 @@
 
 
 #include <vm.h>
+#include <platform/maxcpus.h>
 #include "opt-A3.h"
+#include "opt-dumbvm.h"
 
 struct vnode;
+struct array;
+struct lock;
+struct pagetable;
 
 
 /* 
@@ -48,6 +53,8 @@ struct vnode;
  * You write this.
  */
 
+#if OPT_DUMBVM
+
 struct addrspace {
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
@@ -62,6 +69,101 @@ struct addrspace {
   #endif
 };
 
+#else
+
+/*
+ * Hard limit on the user stack, in pages. The whole range below
+ * USERSTACK is reserved for the stack, but like any other region its
+ * pages only get frames when first touched, so an unused stack costs
+ * nothing. 1024 pages is 4M: exactly one second-level page table.
+ */
+#define VM_STACKPAGES    1024
+
+/*
+ * Read-around: a fault that has to go to disk (executable or swap)
+ * reads up to as_ra_window pages in one request, the faulting page
+ * and those after it, adapting the window between VM_RAMIN and
+ * VM_RAMAX according to how many prefetched pages get used.
+ */
+#define VM_RAMIN         2
+#define VM_RAMAX         16
+
+/* Region permission bits (same values as the ELF PF_* flags). */
+#define AR_EXEC   0x1
+#define AR_WRITE  0x2
+#define AR_READ   0x4
+#define AR_SHARED 0x8   /* file mapping shared with other mappers */
+
+/*
+ * A contiguous range of valid user addresses. Pages inside a region
+ * are only given frames when they are first touched. If the region
+ * comes from the executable, the ar_filesize bytes starting at
+ * ar_filevaddr are read from as_vnode at ar_fileoffset as their pages
+ * are touched; everything else starts out zero.
+ *
+ * A region made by mmap instead maps ar_mapvnode from ar_mapoffset
+ * on, through the page cache.
+ */
+struct as_region {
+  vaddr_t ar_vbase;
+  size_t ar_npages;
+  int ar_perm;
+  vaddr_t ar_filevaddr;
+  off_t ar_fileoffset;
+  size_t ar_filesize;
+  struct vnode *ar_mapvnode;
+  off_t ar_mapoffset;
+};
+
+struct addrspace {
+  struct pagetable *as_pt;        /* virtual -> physical mappings */
+  struct array *as_regions;       /* struct as_region * */
+  struct lock *as_lock;           /* protects as_pt */
+  bool loadelf_finish;            /* read-only regions are enforced */
+  unsigned as_evicting;           /* pageouts in progress (coremap lock) */
+  uint32_t as_asid[MAXCPUS];      /* TLB tag on each cpu, or 0 (vm.c) */
+  struct vnode *as_vnode;         /* executable the regions come from */
+  struct as_region *as_heap;      /* grown and shrunk by sbrk */
+  vaddr_t as_brk;                 /* current end of the heap */
+  unsigned as_ra_window;          /* pages per read-around */
+  unsigned as_ra_num;             /* pages prefetched last time... */
+  vaddr_t as_ra_vaddr[VM_RAMAX];  /* ...where they are... */
+  paddr_t as_ra_paddr[VM_RAMAX];  /* ...and their frames */
+};
+
+/*
+ * as_find_region - return the region containing VADDR, or NULL if
+ *                  VADDR is not a valid user address in AS.
+ *
+ * as_define_file - note that the FILESIZE bytes at VADDR, which must
+ *                  lie in a region already defined, are at OFFSET in
+ *                  V. They are read in by vm_fault a page at a time.
+ *                  AS keeps a reference to V until it is destroyed.
+ *
+ * as_sbrk        - move the end of the heap by AMOUNT bytes and hand
+ *                  back the old end in *OLDBRK. The heap starts out
+ *                  empty just above the executable; pages given back
+ *                  by shrinking it lose their contents.
+ *
+ * as_mmap        - map LEN bytes of V from OFFSET on, with PROT and
+ *                  FLAGS as for mmap(). The address is returned in
+ *                  *ADDR; with MAP_FIXED, it is taken from there.
+ *
+ * as_munmap      - remove the mapping at ADDR. LEN must cover the
+ *                  whole of one mapping.
+ */
+struct as_region *as_find_region(struct addrspace *as, vaddr_t vaddr);
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 struct vnode *v, off_t offset,
+                                 size_t filesize);
+int               as_sbrk(struct addrspace *as, int amount, vaddr_t *oldbrk);
+int               as_mmap(struct addrspace *as, vaddr_t *addr, size_t len,
+                          int prot, int flags, struct vnode *v,
+                          off_t offset);
+int               as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+
+#endif /* OPT_DUMBVM */
+
 /*
  * Functions in addrspace.c:
  *
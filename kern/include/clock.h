@@ -38,10 +38,12 @@
  * hardclock() is called on every CPU HZ times a second, possibly only
  * when the CPU is not idle, for scheduling.
  *
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timerclock() is called on one CPU when the alarm set by the timeout
+ * code goes off; it runs expired timeouts. timerclock_attach() is
+ * called by the timer device driver to supply the alarm.
  *
- * gettime() may be used to fetch the current time of day.
+ * gettime() may be used to fetch the current time of day, and
+ * clock_nsecs() gets the same as a single count of nanoseconds.
  * getinterval() computes the time from time1 to time2.
  *
  * XXX we have struct timespec now, let's use it.
@@ -60,6 +62,8 @@ void hardclock_bootstrap(void);
 
 void hardclock(void);
 void timerclock(void);
+void timerclock_attach(void *devdata, void (*setalarm)(void *, uint32_t));
+uint64_t clock_nsecs(void);
 
 void gettime(time_t *seconds, uint32_t *nanoseconds);
 
@@ -67,18 +71,39 @@ void getinterval(time_t secs1, uint32_t nsecs,
                  time_t secs2, uint32_t nsecs2,
                  time_t *rsecs, uint32_t *rnsecs);
 
+/*
+ * Timeouts. timeout_set arranges for FUNC(DATA) to be called from the
+ * timer interrupt once clock_nsecs() reaches WHEN, to within about
+ * 10 usec. FUNC must not sleep. The struct timeout belongs to the
+ * timeout code until then. Fails with ENOMEM if the table of pending
+ * timeouts can't grow.
+ */
+struct timeout {
+	uint64_t to_when;		/* deadline, in clock_nsecs() time */
+	void (*to_func)(void *);
+	void *to_data;
+	int to_index;			/* position in the heap, or -1 */
+};
+
+int timeout_set(struct timeout *to, uint64_t when,
+		void (*func)(void *), void *data);
+
+/*
+ * clocknanosleep() suspends execution for NSECS nanoseconds. It can
+ * only fail (ENOMEM) as timeout_set can.
+ */
+int clocknanosleep(uint64_t nsecs);
+
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
- *
- *  this will be more efficient than clocknap() for longer sleeps
  */
 void clocksleep(int seconds);
 
 /*
  * clocknap() suspends execution for the requested number of timer ticks
  *
- * the timer ticks every LT_GRANULARITY usec (see kern/dev/ltimer.h)
+ * a tick is LT_GRANULARITY usec (see kern/dev/ltimer.h)
  *
  */
 void clocknap(int ticks);
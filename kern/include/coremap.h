@@ -0,0 +1,113 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page frame management.
+ *
+ * The coremap tracks every page frame between the end of the kernel
+ * image and the top of RAM. Kernel allocations (alloc_kpages) may ask
+ * for several physically contiguous frames; user pages are always
+ * allocated one frame at a time so that address spaces never need
+ * contiguous physical memory.
+ *
+ *    coremap_bootstrap - take over the memory left by ram_stealmem.
+ *                        Called once from vm_bootstrap.
+ *
+ *    coremap_getppages - allocate NPAGES contiguous frames. Returns 0
+ *                        if no such run is free.
+ *
+ *    coremap_freeppages - release a run previously handed out by
+ *                        coremap_getppages.
+ *
+ *    coremap_freecount - number of frames currently free in the
+ *                        buddy lists (per-cpu caches not included).
+ *
+ *    coremap_printstats - print free memory and per-cpu frame cache
+ *                        hit rates (menu command "cm").
+ *
+ *    page_alloc        - allocate one zero-filled frame to hold VADDR in
+ *                        AS. If no frame is free, pages one out first,
+ *                        so the caller must not hold any address space
+ *                        lock. Returns 0 if memory is exhausted.
+ *
+ *    page_share        - add a reference to a user frame, e.g. when
+ *                        fork maps it into the child copy-on-write.
+ *
+ *    page_refcount     - number of page tables currently mapping a
+ *                        user frame.
+ *
+ *    page_free         - drop a reference to a user frame; the frame
+ *                        is released when the last one goes.
+ *
+ *    page_tryalloc     - like page_alloc, but return 0 rather than page
+ *                        anything out. Safe with an address space lock
+ *                        held; for allocations that are only worth
+ *                        making if memory is plentiful.
+ *
+ *    page_touch        - mark the frame referenced. Called each time
+ *                        the frame is loaded into the TLB.
+ *
+ *    page_untouch      - mark the frame unreferenced, e.g. when it is
+ *                        read in before anybody asked for it.
+ *
+ *    page_touched      - has the frame been referenced since it was
+ *                        last marked unreferenced (by page_untouch or
+ *                        the replacement clock)?
+ *
+ *    page_pin          - make a user frame permanent. It is never paged
+ *                        out or freed, page_share and page_free ignore
+ *                        it, and page_refcount calls it shared. Used
+ *                        for the zero page (see vm.c).
+ *
+ *    page_claim        - record AS and VADDR as the owner of a frame
+ *                        that was shared and now has a single mapper,
+ *                        making it a candidate for paging out again.
+ *
+ * Page replacement (see swap.c):
+ *
+ *    page_evict_select - run the clock hand to pick a victim frame.
+ *                        Returns 0 if nothing can be paged out; else
+ *                        the frame is marked busy, its owner and
+ *                        address are returned, and the owner's
+ *                        as_evicting count is raised.
+ *
+ *    page_evict_check  - with AS's lock held, check that the victim is
+ *                        still mapped by AS alone.
+ *
+ *    page_evict_done   - finish with a victim. If EVICTED, its contents
+ *                        are safe in swap and the frame is freed.
+ *
+ *    page_evict_wait   - wait for in-progress evictions from AS to
+ *                        finish; used by as_destroy.
+ */
+
+#include <vm.h>
+
+struct addrspace;
+
+void    coremap_bootstrap(void);
+paddr_t coremap_getppages(unsigned long npages);
+void    coremap_freeppages(paddr_t paddr);
+unsigned long coremap_freecount(void);
+void    coremap_printstats(void);
+
+/* Per-frame idle bytes, indexed by paddr >> 12 (see coremap.c). */
+extern uint8_t *coremap_idle;
+
+paddr_t  page_alloc(struct addrspace *as, vaddr_t vaddr);
+paddr_t  page_tryalloc(struct addrspace *as, vaddr_t vaddr);
+void     page_share(paddr_t paddr);
+unsigned page_refcount(paddr_t paddr);
+void     page_free(paddr_t paddr);
+void     page_pin(paddr_t paddr);
+void     page_touch(paddr_t paddr);
+void     page_untouch(paddr_t paddr);
+bool     page_touched(paddr_t paddr);
+void     page_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+
+paddr_t  page_evict_select(struct addrspace **as, vaddr_t *vaddr);
+bool     page_evict_check(paddr_t paddr, struct addrspace *as);
+void     page_evict_done(paddr_t paddr, struct addrspace *as, bool evicted);
+void     page_evict_wait(struct addrspace *as);
+
+#endif /* _COREMAP_H_ */
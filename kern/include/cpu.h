@@ -36,6 +36,36 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * Per-cpu cache ("magazine") of free page frames kept in front of the
+ * coremap, so that most single-frame allocations and frees don't need
+ * the global coremap lock. See vm/coremap.c.
+ */
+#define FRAMECACHE_SIZE   32	/* Most frames a cpu will hold */
+#define FRAMECACHE_BATCH  16	/* Frames moved to/from the coremap at once */
+
+struct framecache {
+	struct spinlock fc_lock;	/* Protects the rest */
+	paddr_t fc_frames[FRAMECACHE_SIZE];
+	unsigned fc_count;	/* Frames currently in fc_frames */
+	unsigned fc_allocs;	/* Single-frame allocations on this cpu */
+	unsigned fc_allochits;	/* ...of which fc_frames wasn't empty */
+	unsigned fc_frees;	/* Single-frame frees on this cpu */
+	unsigned fc_freehits;	/* ...of which fc_frames wasn't full */
+};
+
+/*
+ * Per-cpu cache of free kernel stacks, in front of the global pool
+ * (kstack option). See vm/kstack.c.
+ */
+#define KSTACKCACHE_SIZE  8	/* Most free stacks a cpu will hold */
+
+struct kstackcache {
+	unsigned kc_slots[KSTACKCACHE_SIZE];	/* Pool slot numbers */
+	unsigned kc_count;	/* Slots currently in kc_slots */
+	unsigned kc_set;	/* TLB slot set wired to the running stack */
+};
+
 /*
  * Per-cpu structure
  *
@@ -59,7 +89,16 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct thread *c_moving;	/* Thread leaving (thread_moveout) */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	struct framecache c_framecache;	/* Free frames */
+	struct kstackcache c_kstacks;	/* Free stacks; interrupts off */
+	uint32_t c_asid_last;		/* Last ASID handed out (see vm.c) */
+	uint32_t c_asid_cur;		/* ASID of the active address space */
+	unsigned c_tlb_hand;		/* Next round-robin TLB victim */
+	uint64_t c_tlb_plru;		/* Pseudo-LRU tree over TLB slots */
+	unsigned c_steals;		/* Threads taken by this cpu idling */
+	unsigned c_migrations;		/* Threads pushed to other cpus */
 
 	/*
 	 * Accessed by other cpus.
@@ -68,6 +107,9 @@ struct cpu {
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
+	unsigned c_wakeups;		/* Woken threads run here */
+	uint64_t c_wakewait;		/* Total wakeup-to-run nsecs */
+	uint32_t c_wakewait_max;	/* Longest wakeup-to-run nsecs */
 
 	/*
 	 * Accessed by other cpus.
@@ -109,6 +151,12 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Number of cpus in the system, and the cpu whose c_number is NUM.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned num);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -0,0 +1,78 @@
+#ifndef _KSTACK_H_
+#define _KSTACK_H_
+
+/*
+ * Pooled kernel thread stacks (kstack option).
+ *
+ * Thread stacks live in a region of kernel virtual memory (kseg2)
+ * carved into slots. Each slot is an unmapped guard region of
+ * STACK_SIZE bytes with the stack above it, so a thread that runs off
+ * the bottom of its stack faults at once and the kernel panics with
+ * "Kernel stack overflow" instead of quietly trashing whatever memory
+ * happened to be next to the stack. A slot gets its memory the first
+ * time it is used and keeps it; freed stacks go on a per-cpu free list
+ * (struct kstackcache) and, when that is full, on a global one, so
+ * thread creation rarely touches the coremap or a shared lock.
+ *
+ * The stack of the running thread must never take a TLB miss, since
+ * the exception code saves the trap frame on it. kstack_activate wires
+ * each stack into TLB slots below KSTACK_TLBSLOTS before switching to
+ * it, which tlb_random and the UTLB refill never choose and vm.c
+ * leaves alone. There are two sets of slots, so that the stack being
+ * switched from stays mapped until the switch is done. Other threads'
+ * stacks (touched by thread_fork, say) are loaded on demand by
+ * kstack_fault.
+ *
+ * Stacks handed out before kstack_bootstrap come from kmalloc and are
+ * not guarded.
+ *
+ *    kstack_bootstrap - start handing out pooled stacks. Called from
+ *                       vm_bootstrap once the coremap is up.
+ *
+ *    kstack_alloc     - get a stack of STACK_SIZE bytes. Returns NULL
+ *                       if out of memory.
+ *
+ *    kstack_free      - give back a stack from kstack_alloc.
+ *
+ *    kstack_activate  - make STACK safe to run on, on this cpu. STACK
+ *                       may be NULL or unpooled. Interrupts must be off.
+ *
+ *    kstack_fault     - handle a kernel TLB miss on VADDR. Returns
+ *                       false if VADDR is not in a stack that has been
+ *                       handed out.
+ *
+ *    kstack_isguard   - is VADDR in a guard region?
+ *
+ * A trap taken with the stack pointer in a guard region, or within
+ * KSTACK_SLOP bytes above one, would fault again saving its trap
+ * frame; exception.S puts the frame on the cpu's fault stack instead
+ * (see cpustackguards in trapframe.h), and mips_trap panics.
+ */
+
+#include <vm.h>
+#include <thread.h>
+
+/* Where the pool lives, and the most stacks it holds. */
+#define KSTACK_BASE	MIPS_KSEG2
+#define KSTACK_MAX	1024
+
+/* Room a trap frame needs at the bottom of a stack (it is 168 bytes). */
+#define KSTACK_SLOP	256
+
+/* TLB slots reserved for the running stacks: two sets. */
+#define KSTACK_PAGES	(STACK_SIZE / PAGE_SIZE)
+#define KSTACK_TLBSLOTS	(2 * KSTACK_PAGES)
+
+#if KSTACK_TLBSLOTS > 8
+/* The MIPS-1 Random register never goes below 8. */
+#error "STACK_SIZE is too large for the kstack option"
+#endif
+
+void kstack_bootstrap(void);
+void *kstack_alloc(void);
+void kstack_free(void *stack);
+void kstack_activate(void *stack);
+bool kstack_fault(vaddr_t vaddr);
+bool kstack_isguard(vaddr_t vaddr);
+
+#endif /* _KSTACK_H_ */
@@ -0,0 +1,46 @@
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+/*
+ * Lock contention profiler (lockprof option).
+ *
+ * Spinlocks, sleep locks and wait channels report each use here, and
+ * the profiler adds them up in one table so the busiest can be found.
+ * Sleep locks are grouped by lk_name and wait channels by wc_name;
+ * all the locks with the same name share an entry. Spinlocks have no
+ * names, so they are grouped by the address of the code that called
+ * spinlock_acquire (look it up with addr2line or nm).
+ *
+ * Spinlock times are in cycles, as counted by spinlock_cycles().
+ * Sleep lock and wait channel times are in nanoseconds; they are only
+ * measured once lockprof_bootstrap has been called, because reading
+ * the clock needs the clock device.
+ *
+ *    lockprof_bootstrap - start timing sleep locks and wait channels.
+ *                         Call once the clock device is attached.
+ *
+ *    lockprof_now       - the time to pass back to lockprof_record for
+ *                         a sleep lock or wait channel, or 0 if it
+ *                         can't be read yet.
+ *
+ *    lockprof_record    - count one use: CONTENDED if the caller had to
+ *                         wait, for WAIT, and held the lock for HOLD.
+ *                         SITE is the key for LOCKPROF_SPIN, NAME for
+ *                         the others. Safe to call with spinlocks held
+ *                         and from inside spinlock_release.
+ *
+ *    lockprof_print     - print the table, worst wait first, and clear
+ *                         it (menu command "lp").
+ */
+
+#define LOCKPROF_SPIN	0	/* struct spinlock */
+#define LOCKPROF_LOCK	1	/* struct lock */
+#define LOCKPROF_WCHAN	2	/* struct wchan */
+
+void lockprof_bootstrap(void);
+uint64_t lockprof_now(void);
+void lockprof_record(unsigned kind, const void *site, const char *name,
+		     bool contended, uint64_t wait, uint64_t hold);
+void lockprof_print(void);
+
+#endif /* _LOCKPROF_H_ */
@@ -0,0 +1,47 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for memory-mapped files.
+ *
+ * Every file that is mapped into some address space has one set of
+ * cached pages, keyed by the vnode and the page's offset in the file.
+ * All mappings of a page map the same frame: shared mappings write to
+ * it directly, and private mappings map it copy-on-write. A file's
+ * pages stay cached, and can't be paged out, for as long as it is
+ * mapped anywhere.
+ *
+ *    pagecache_bootstrap - set up. Called from vm_bootstrap.
+ *
+ *    pagecache_open  - note a new mapping of V. Fails if V can't be
+ *                      mapped (see VOP_MMAP).
+ *
+ *    pagecache_close - drop a mapping of V. When the last one goes,
+ *                      dirty pages are written back and the cache for
+ *                      V is thrown away.
+ *
+ *    pagecache_get   - return in *RET the frame holding the page at
+ *                      OFFSET in V, reading it in if it isn't cached.
+ *                      The caller gets a reference to the frame, which
+ *                      it drops with page_free. Must be called without
+ *                      any address space lock held.
+ *
+ *    pagecache_dirty - note that the page at OFFSET in V has been made
+ *                      writable through a shared mapping.
+ *
+ *    pagecache_flush - write V's dirty pages back to the file. Called
+ *                      from VOP_FSYNC; does nothing if V isn't mapped.
+ */
+
+#include <vm.h>
+
+struct vnode;
+
+void pagecache_bootstrap(void);
+int  pagecache_open(struct vnode *v);
+void pagecache_close(struct vnode *v);
+int  pagecache_get(struct vnode *v, off_t offset, paddr_t *ret);
+void pagecache_dirty(struct vnode *v, off_t offset);
+int  pagecache_flush(struct vnode *v);
+
+#endif /* _PAGECACHE_H_ */
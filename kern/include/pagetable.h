@@ -0,0 +1,94 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page table.
+ *
+ * A user virtual address is split 10/10/12: the top 10 bits index the
+ * page directory, the next 10 bits index a second-level table, and the
+ * low 12 bits are the offset in the page. The directory and each
+ * second-level table are exactly one page. Second-level tables are
+ * only allocated once something in their 4M slice is touched.
+ *
+ * A page table entry uses the same layout as the MIPS TLBLO word, so
+ * a resident entry can be handed to the TLB after masking off the
+ * software bits:
+ *
+ *    PTE_FRAME   physical frame number         (TLBLO_PPAGE)
+ *    PTE_WRITE   page may be written           (TLBLO_DIRTY)
+ *    PTE_VALID   page is resident at PTE_FRAME (TLBLO_VALID)
+ *    PTE_COW     frame is shared copy-on-write; the page is writable
+ *                but PTE_WRITE stays clear until the share is broken
+ *    PTE_SWAPPED page has been paged out; PTE_VALID is clear and the
+ *                frame bits hold its swap slot instead
+ *    PTE_SHARED  frame belongs to the page cache through a shared file
+ *                mapping; it is never copied on write or paged out
+ *
+ * An entry of 0 means the page has never been touched.
+ */
+
+#include <mips/tlb.h>
+
+typedef uint32_t pte_t;
+
+#define PTE_FRAME	TLBLO_PPAGE
+#define PTE_WRITE	TLBLO_DIRTY
+#define PTE_VALID	TLBLO_VALID
+#define PTE_COW		0x00000001
+#define PTE_SWAPPED	0x00000002
+#define PTE_SHARED	0x00000004
+
+/* Swap slot of a paged-out entry. */
+#define PTE_SWAPSLOT(pte)	((pte) >> 12)
+#define PTE_MKSWAP(slot)	(((pte_t)(slot) << 12) | PTE_SWAPPED)
+
+/* Bits of a PTE that may be loaded into the TLB. */
+#define PTE_TLBMASK	(PTE_FRAME | PTE_WRITE | PTE_VALID)
+
+#define PT_ENTRIES	1024
+#define PT_DIRINDEX(va)	(((va) >> 22) & (PT_ENTRIES - 1))
+#define PT_TABINDEX(va)	(((va) >> 12) & (PT_ENTRIES - 1))
+
+struct pagetable {
+	pte_t *pt_dir[PT_ENTRIES];
+};
+
+/*
+ * The UTLB refill handler in exception-mips1.S walks, for each cpu,
+ * the directory vm_curpagedir[cpu] without taking any locks, loading
+ * any entry with PTE_VALID set and sending everything else on to
+ * vm_fault. NULL disables it. It counts its refills in vm_fastrefills.
+ * See vm.c.
+ */
+extern pte_t **vm_curpagedir[];
+extern unsigned vm_fastrefills[];
+
+/*
+ *    pt_create  - allocate an empty page table. Returns NULL if out
+ *                 of memory.
+ *
+ *    pt_destroy - free the table, every frame it still maps, and
+ *                 every swap slot it still holds.
+ *
+ *    pt_lookup  - return a pointer to the PTE for VADDR. If CREATE is
+ *                 set, missing second-level tables are allocated;
+ *                 otherwise (or if that allocation fails) NULL is
+ *                 returned for an address with no table.
+ *
+ *    pt_copy    - make NEW map every resident page of OLD. Writable
+ *                 pages other than shared file pages (PTE_SHARED)
+ *                 become copy-on-write in both tables, so the
+ *                 caller must flush OLD's stale TLB entries. Paged-out
+ *                 pages share their swap slot. NEW must be empty.
+ *
+ *    pt_clear   - unmap the pages from START up to END, releasing
+ *                 their frames and swap slots. The caller must flush
+ *                 any TLB entries for them.
+ */
+struct pagetable *pt_create(void);
+void              pt_destroy(struct pagetable *pt);
+pte_t            *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+int               pt_copy(struct pagetable *old, struct pagetable *new);
+void              pt_clear(struct pagetable *pt, vaddr_t start, vaddr_t end);
+
+#endif /* _PAGETABLE_H_ */
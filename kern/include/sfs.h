@@ -48,11 +48,32 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * SFS does not use vfs_biglock. Locks are taken in this order:
+ *
+ *    sv_lock of a directory
+ *    sv_lock of a file in that directory
+ *    sfs_vnlock
+ *    sfs_freemaplock
+ *
+ * sv_lock covers sv_i and sv_dirty, and is held for reading by lookups,
+ * reads and stat, and for writing by anything that changes the inode or
+ * its blocks. sfs_vnlock covers sfs_vnodes; sfs_freemaplock covers
+ * sfs_freemap, sfs_freemapdirty and sfs_superdirty. The superblock is
+ * otherwise read-only once mounted.
+ *
+ * No sv_lock is held while touching user memory: the page fault path
+ * holds the faulting process's as_lock and may read its executable,
+ * so as_lock comes before every sv_lock. sfs_read and sfs_write copy
+ * user data through a kernel buffer for this reason.
+ */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct rwlock *sv_lock;         /* lock for sv_i and sv_dirty */
 };
 
 struct sfs_fs {
@@ -63,6 +84,8 @@ struct sfs_fs {
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct lock *sfs_vnlock;        /* lock for sfs_vnodes */
+	struct lock *sfs_freemaplock;   /* lock for sfs_freemap */
 };
 
 /*
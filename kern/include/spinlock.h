@@ -36,6 +36,8 @@
  */
 
 #include <cdefs.h>
+#include "opt-lockstat.h"
+#include "opt-lockprof.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -53,16 +55,42 @@
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
+ *
+ * These are ticket locks: each CPU that wants the lock takes the next
+ * number from lk_next and waits until lk_serving reaches it, so CPUs
+ * get the lock in the order they asked for it.
+ *
+ * With the lockstat option, each lock also counts its acquisitions,
+ * how many of them had to wait and for how many passes through the
+ * wait loop, and how long (in cycles) it was held. With lockprof, the
+ * holder's wait and hold times go to the profiler (see lockprof.h).
  */
 struct spinlock {
-	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+	volatile spinlock_data_t lk_next;    /* Next ticket to hand out. */
+	volatile spinlock_data_t lk_serving; /* Ticket that holds the lock. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_LOCKSTAT
+	unsigned lk_acquires;
+	unsigned lk_contended;
+	uint64_t lk_spins;
+	uint64_t lk_holdtotal;
+	uint32_t lk_holdmax;
+	uint32_t lk_stamp;		/* when the holder got it */
+#endif
+#if OPT_LOCKPROF
+	const void *lk_profsite;	/* where the holder acquired it */
+	bool lk_profcontended;		/* the holder had to wait */
+	uint32_t lk_profwait;		/* cycles it waited */
+	uint32_t lk_profstamp;		/* when it got the lock */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ .lk_next = SPINLOCK_DATA_INITIALIZER, \
+				  .lk_serving = SPINLOCK_DATA_INITIALIZER, \
+				  .lk_holder = NULL }
 
 /*
  * Spinlock functions.
@@ -74,6 +102,9 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * printstats	Print the lock's statistics under NAME and clear them
+ *		(lockstat option only).
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -84,5 +115,9 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+#if OPT_LOCKSTAT
+void spinlock_printstats(struct spinlock *lk, const char *name);
+#endif
+
 
 #endif /* _SPINLOCK_H_ */
@@ -0,0 +1,61 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space and page-out.
+ *
+ * Paged-out user pages live on the raw disk SWAP_DEVICE, one page per
+ * slot. A bitmap records which slots are in use; a slot can be shared
+ * by several page tables after fork, so each also has a reference
+ * count. If the device is missing, the system runs without swap.
+ *
+ * A pageout thread keeps some frames free: it is woken when the free
+ * count drops below PAGEOUT_LOW and pages out until it is back above
+ * PAGEOUT_HIGH, so that faults rarely have to wait for a disk write.
+ * When memory runs out anyway, page_alloc calls swap_pageout itself.
+ *
+ *    swap_bootstrap - open the swap device and start the pageout
+ *                     thread. Called from vm_bootstrap.
+ *
+ *    swap_alloc     - reserve a free slot. Returns ENOSPC if there is
+ *                     none (or no swap at all).
+ *
+ *    swap_share     - add a reference to a slot.
+ *
+ *    swap_free      - drop a reference to a slot; the slot is released
+ *                     when the last one goes.
+ *
+ *    swap_read      - read SLOT into the frame at PADDR.
+ *
+ *    swap_readv     - read the N slots from SLOT on into the frames at
+ *                     PADDRS[0..N-1], in one request.
+ *
+ *    swap_write     - write the frame at PADDR to SLOT.
+ *
+ *    swap_pageout   - choose a victim frame and page it out. Returns 0
+ *                     if a frame was freed or it is worth trying again,
+ *                     or an error if nothing can be paged out. Must be
+ *                     called without any address space lock held.
+ *
+ *    swap_wakeup    - prod the pageout thread. Safe in any context.
+ */
+
+#include <vm.h>
+
+#define SWAP_DEVICE	"lhd1raw:"
+
+/* Free frame watermarks for the pageout thread. */
+#define PAGEOUT_LOW	16
+#define PAGEOUT_HIGH	32
+
+void swap_bootstrap(void);
+int  swap_alloc(unsigned *slot);
+void swap_share(unsigned slot);
+void swap_free(unsigned slot);
+int  swap_read(paddr_t paddr, unsigned slot);
+int  swap_readv(const paddr_t *paddrs, unsigned slot, unsigned n);
+int  swap_write(paddr_t paddr, unsigned slot);
+int  swap_pageout(void);
+void swap_wakeup(void);
+
+#endif /* _SWAP_H_ */
@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include "opt-lockprof.h"
 
 /*
  * Dijkstra-style semaphore.
@@ -71,24 +72,49 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * Locks are adaptive: a thread that finds the lock held spins while
+ * the holder is running on another CPU, on the theory that it will
+ * let go soon, and only sleeps if the holder is not running or the
+ * spin runs out. A release with sleepers hands the lock straight to
+ * the one it wakes; one without skips the wait channel.
+ *
+ * The counters are for profiling: lk_acquires counts every successful
+ * acquire; lk_contended those that found the lock held, of which
+ * lk_spun got it by spinning and lk_slept had to sleep. With the
+ * lockprof option the holder's wait and hold times also go to the
+ * profiler, under lk_name, when it releases the lock.
  */
 struct lock {
         char *lk_name;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
-        struct thread *owner;
+        struct thread *volatile owner;	/* NULL while being handed off */
         struct wchan *lk_wchan;
         struct spinlock lk_spin;
         volatile bool held;
+        unsigned lk_waiters;		/* threads asleep on lk_wchan */
+        bool lk_handoff;		/* held for a waiter being woken */
+
+        unsigned lk_acquires;
+        unsigned lk_contended;
+        unsigned lk_spun;
+        unsigned lk_slept;
+#if OPT_LOCKPROF
+        bool lk_profcontended;		/* the holder had to wait */
+        uint64_t lk_profwait;		/* nsecs it waited */
+        uint64_t lk_profstamp;		/* when it got the lock */
+#endif
 };
 
 struct lock *lock_create(const char *name);
 void lock_acquire(struct lock *);
+bool lock_tryacquire(struct lock *);
 
 /*
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
  *                   same time.
+ *    lock_tryacquire - Get the lock if it is free; return false instead
+ *                   of sleeping if it is not.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock; 
@@ -144,4 +170,52 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers queue
+ * behind it rather than starving it. To keep readers from starving in
+ * turn, a writer that releases the lock with readers queued admits all
+ * of them together, as one batch, before the next writer gets a turn.
+ * Either way the lock is handed straight to the threads being woken,
+ * so nobody can barge in ahead of them.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+        char *rwlock_name;
+        struct spinlock rw_spin;
+        struct wchan *rw_rwchan;	/* readers wait here */
+        struct wchan *rw_wwchan;	/* writers wait here */
+        unsigned rw_readers;		/* readers holding the lock */
+        struct thread *rw_writer;	/* writer holding it, or NULL */
+        unsigned rw_rwaiting;		/* threads asleep on rw_rwchan */
+        unsigned rw_wwaiting;		/* threads asleep on rw_wwchan */
+        bool rw_handoff;		/* held for a writer being woken */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. Other readers
+ *                           may hold it at the same time.
+ *    rwlock_release_read  - Free a read hold.
+ *    rwlock_acquire_write - Get the lock for writing. Only one thread
+ *                           can hold it this way, and no readers.
+ *    rwlock_release_write - Free a write hold. Only the thread holding
+ *                           the lock for writing may do this.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
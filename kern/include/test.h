@@ -58,9 +58,13 @@ int queuetest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int threadtest4(int, char **);
+int threadtest5(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int rwtest(int, char **);
+int rwbench(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -77,6 +81,9 @@ int writestress2(int, char **);
 int createstress(int, char **);
 int printfile(int, char **);
 
+/* vm tests */
+int mmaptest(int, char **);
+
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
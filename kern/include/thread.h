@@ -39,6 +39,7 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include "opt-kstack.h"
 
 struct cpu;
 
@@ -46,10 +47,22 @@ struct cpu;
 #include <machine/thread.h>
 
 
-/* Size of kernel stacks; must be power of 2 */
+/*
+ * Size of kernel stacks; must be power of 2. Pooled stacks (see
+ * kstack.h) are bigger, since running out is caught there, but at
+ * most four pages.
+ */
+#if OPT_KSTACK
+#define STACK_SIZE 8192
+#else
 #define STACK_SIZE 4096
+#endif
 
-/* Mask for extracting the stack base address of a kernel stack pointer */
+/*
+ * Mask for extracting the stack base address of a kernel stack pointer.
+ * Only good for stacks aligned to STACK_SIZE, which kmalloc'd stacks
+ * bigger than a page need not be.
+ */
 #define STACK_MASK  (~(vaddr_t)(STACK_SIZE-1))
 
 /* Macro to test if two addresses are on the same kernel stack */
@@ -101,6 +114,24 @@ struct thread {
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
+	/*
+	 * Scheduler fields. Protected by t_cpu's runqueue lock, except
+	 * while the thread is on no list and not running, when whoever
+	 * took it off its wait channel owns it.
+	 *
+	 * t_priority and t_ticks are only used with options mlfq; see
+	 * the notes above schedule() in thread.c.
+	 */
+	uint32_t t_affinity;		/* CPUs allowed, bit N for cpu N */
+	unsigned t_lastrun;		/* t_cpu's c_hardclocks when it stopped */
+	bool t_moving;			/* Leave t_cpu at the next yield */
+	unsigned t_priority;		/* Queue level; 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	bool t_woken;			/* Woken from a wchan, not yet run */
+	time_t t_wakesecs;		/* When it was woken */
+	uint32_t t_wakensecs;
+	uint64_t t_sleptat;		/* When it slept, with lockprof */
+
 	/*
 	 * Public fields
 	 */
@@ -108,6 +139,9 @@ struct thread {
 	/* add more here as needed */
 };
 
+/* Value of t_affinity for a thread that may run anywhere. */
+#define THREAD_AFFINITY_ALL	0xffffffff
+
 /*
  * Array of threads.
  */
@@ -144,6 +178,15 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+/*
+ * Restrict the current thread to the CPUs whose bits are set in MASK
+ * (bit N for cpu N), moving it if need be before returning. Threads
+ * it forks afterwards inherit the mask. Returns EINVAL if MASK names
+ * no CPU that exists, or ENOMEM if the move runs out of memory (the
+ * mask is set anyway). May sleep.
+ */
+int thread_setaffinity(uint32_t mask);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -157,6 +200,12 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge a clock tick to the current thread and, if the scheduler
+ * says so, yield. Called from the timer interrupt.
+ */
+void thread_preempt(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
@@ -168,5 +217,13 @@ void schedule(void);
  */
 void thread_consider_migration(void);
 
+/*
+ * Print, and then clear, each CPU's wakeup-to-run latency: the time
+ * from wchan_wake* making a thread runnable until it gets the CPU.
+ * Also prints the running count of threads each CPU has stolen and
+ * migrated. (Menu command "ss".)
+ */
+void thread_printstats(void);
+
 
 #endif /* _THREAD_H_ */
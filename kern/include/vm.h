@@ -55,6 +55,30 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/* Invalidate every entry in this CPU's TLB but the wired stacks */
+void vm_tlb_flush(void);
+
+/* Put this CPU's ASID back in ENTRYHI after using the tlb_* calls */
+void vm_asid_restore(void);
+
+/* Give AS an ASID on this CPU if it has none, and make it current */
+void vm_asid_activate(struct addrspace *as);
+
+/* Drop AS's ASIDs on every CPU, orphaning its TLB entries everywhere */
+void vm_asid_retire(struct addrspace *as);
+
+/* Stop the fast refill path using AS's page table, on every CPU */
+void vm_refill_forget(struct addrspace *as);
+
+/* Print TLB policy and refill counts (at shutdown, next to vmstats) */
+void vm_printstats(void);
+
+/*
+ * Remove VADDR in AS from every CPU's TLB, waiting until all of them
+ * have done it. The caller must already have invalidated the PTE.
+ */
+void vm_tlbshootdown_wait(struct addrspace *as, vaddr_t vaddr);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
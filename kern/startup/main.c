@@ -50,6 +50,15 @@
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
+#include "opt-vm.h"
+#include "opt-lockprof.h"
+#if OPT_A3
+#include <uw-vmstats.h>
+#endif
+#if OPT_LOCKPROF
+#include <lockprof.h>
+#endif
 
 
 /*
@@ -120,6 +129,10 @@ boot(void)
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
+#if OPT_LOCKPROF
+	/* The clock is attached now. */
+	lockprof_bootstrap();
+#endif
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
@@ -153,6 +166,13 @@ shutdown(void)
 
 	thread_shutdown();
 
+#if OPT_A3
+#if OPT_VM
+	vm_printstats();
+#endif
+	vmstats_print();
+#endif
+
 	splhigh();
 }
 
@@ -45,7 +45,15 @@
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-vm.h"
 #include "opt-A2.h"
+#include "opt-lockprof.h"
+#if OPT_VM
+#include <coremap.h>
+#endif
+#if OPT_LOCKPROF
+#include <lockprof.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -412,6 +420,46 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_LOCKPROF
+static
+int
+cmd_lockprof(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lockprof_print();
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
+#if OPT_VM
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -476,12 +524,16 @@ static const char *testmenu[] = {
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt4] Thread affinity test          ",
+	"[tt5] Nanosleep test                ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Rwlock test                   ",
+	"[sy5] Rwlock benchmark              ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -491,6 +543,9 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+#if OPT_VM
+	"[mm1] mmap test                     ",
+#endif
 	NULL
 };
 
@@ -522,6 +577,13 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+#if OPT_LOCKPROF
+	"[lp] Lock contention profile        ",
+#endif
+	"[ss] Scheduler stats                ",
+#if OPT_VM
+	"[cm] Coremap/frame cache stats      ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -579,6 +641,13 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if OPT_LOCKPROF
+	{ "lp",         cmd_lockprof },
+#endif
+	{ "ss",         cmd_schedstats },
+#if OPT_VM
+	{ "cm",         cmd_coremapstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -591,11 +660,15 @@ static struct {
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt4",	threadtest4 },
+	{ "tt5",	threadtest5 },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwtest },
+	{ "sy5",	rwbench },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -607,6 +680,9 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+#if OPT_VM
+	{ "mm1",	mmaptest },
+#endif
 
 	{ NULL, NULL }
 };
@@ -60,6 +60,7 @@
 #include <vnode.h>
 #include <elf.h>
 #include "opt-A3.h"
+#include "opt-vm.h"
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -82,8 +83,10 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
+#if !OPT_VM
 	struct iovec iov;
 	struct uio u;
+#endif
 	int result;
 
 	if (filesize > memsize) {
@@ -91,6 +94,17 @@ load_segment(struct addrspace *as, struct vnode *v,
 		filesize = memsize;
 	}
 
+#if OPT_VM
+	/*
+	 * Don't read anything now; vm_fault reads each page in from V
+	 * the first time it is touched.
+	 */
+	(void)is_executable;
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
+	result = as_define_file(as, vaddr, v, offset, filesize);
+	return result;
+#else
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n", 
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
@@ -144,6 +158,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 	
 	return result;
+#endif /* OPT_VM */
 }
 
 /*
@@ -282,6 +282,13 @@ sys_getpid(pid_t *retval)
   return(0);
 }
 
+/* pin the calling process to the cpus whose bits are set in mask */
+int
+sys_setaffinity(unsigned mask)
+{
+  return thread_setaffinity(mask);
+}
+
 /* stub handler for waitpid() system call                */
 
 int
@@ -28,6 +28,8 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -56,3 +58,46 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/* Longest sleep sys_nanosleep will do, in seconds (about 136 years). */
+#define NANOSLEEP_MAXSECS	((time_t)1 << 32)
+
+/*
+ * Sleep for the time in *user_req, to the resolution of the timer
+ * device rather than of the hardclock. Nothing can interrupt the
+ * sleep, so *user_rem, if given, is always set to zero.
+ */
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec ts;
+	int result;
+
+	result = copyin(user_req, &ts, sizeof(ts));
+	if (result) {
+		return result;
+	}
+	if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	/* Over a century is as good as forever; don't let it wrap. */
+	if (ts.tv_sec > NANOSLEEP_MAXSECS) {
+		ts.tv_sec = NANOSLEEP_MAXSECS;
+	}
+
+	result = clocknanosleep((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+	if (result) {
+		return result;
+	}
+
+	if (user_rem != NULL) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+		result = copyout(&ts, user_rem, sizeof(ts));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
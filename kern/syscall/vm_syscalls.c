@@ -0,0 +1,86 @@
+/*
+ * Memory management system calls for the paging VM system.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/unistd.h>
+#include <lib.h>
+#include <syscall.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+
+/*
+ * sbrk: move the end of the heap, returning the old end. The new
+ * pages are zero-filled by vm_fault when first touched.
+ */
+int
+sys_sbrk(int amount, vaddr_t *retval)
+{
+  struct addrspace *as;
+
+  DEBUG(DB_SYSCALL,"Syscall: sbrk(%d)\n",amount);
+
+  as = curproc_getas();
+  if (as == NULL) {
+    return ENOMEM;
+  }
+  return as_sbrk(as, amount, retval);
+}
+
+/*
+ * mmap: map part of an open file. As with sys_write, the console is
+ * the only open file a process has so far, and it can't be mapped;
+ * as_mmap does the work once there is a descriptor table to find the
+ * vnode in.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, vaddr_t *retval)
+{
+  struct addrspace *as;
+  struct vnode *v;
+  vaddr_t va;
+  int result;
+
+  DEBUG(DB_SYSCALL,"Syscall: mmap(%x,%u,%d,%d,%d)\n",
+        (unsigned int)addr,len,prot,flags,fd);
+
+  if (!((fd==STDOUT_FILENO)||(fd==STDERR_FILENO))) {
+    return EBADF;
+  }
+  KASSERT(curproc->console != NULL);
+  v = curproc->console;
+
+  as = curproc_getas();
+  if (as == NULL) {
+    return ENOMEM;
+  }
+
+  va = (vaddr_t)addr;
+  result = as_mmap(as, &va, len, prot, flags, v, offset);
+  if (result) {
+    return result;
+  }
+  *retval = va;
+  return 0;
+}
+
+/*
+ * munmap: remove a mapping made by mmap, writing back its dirty pages
+ * if it was the last mapping of a shared file.
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+  struct addrspace *as;
+
+  DEBUG(DB_SYSCALL,"Syscall: munmap(%x,%u)\n",(unsigned int)addr,len);
+
+  as = curproc_getas();
+  if (as == NULL) {
+    return EINVAL;
+  }
+  return as_munmap(as, (vaddr_t)addr, len);
+}
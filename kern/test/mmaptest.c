@@ -0,0 +1,381 @@
+/*
+ * mmaptest - test for mmap of files and the page cache.
+ *
+ * Writes a file two and a half pages long, maps it both shared and
+ * private, and checks that:
+ *
+ *    - both mappings show the file, with zeros past EOF;
+ *    - a write through the private mapping is copied on write: the
+ *      shared mapping and the file never see it;
+ *    - writes through the shared mapping are in the file after
+ *      VOP_FSYNC, and after the last munmap, and the file doesn't
+ *      grow.
+ *
+ * The mappings are touched with copyin/copyout, which fault the pages
+ * in through vm_fault as user accesses would. The kernel process has
+ * no address space of its own, so the test lends it one while it runs.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <uio.h>
+#include <stat.h>
+#include <copyinout.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <proc.h>
+#include <current.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define FILENAME "mmaptest.tmp"
+#define MT_PAGES 3
+#define MT_SIZE  (2 * PAGE_SIZE + PAGE_SIZE / 2)
+
+static int mt_errors;
+
+/*
+ * Byte OFF of the file as written by step GEN of the test. Never
+ * zero, so it can't be mistaken for the fill past EOF. GEN -1 means
+ * zeros.
+ */
+static
+char
+mt_byte(off_t off, int gen)
+{
+	if (gen < 0) {
+		return 0;
+	}
+	return (off * 7 + gen * 13) % 251 + 1;
+}
+
+static
+void
+mt_fill(char *buf, off_t off, size_t len, int gen)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		buf[i] = mt_byte(off + i, gen);
+	}
+}
+
+static
+void
+mt_check(const char *what, const char *buf, off_t off, size_t len, int gen)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		if (buf[i] != mt_byte(off + i, gen)) {
+			kprintf("mmaptest: %s: offset %llu: got %d, "
+				"expected %d\n", what, off + i, buf[i],
+				mt_byte(off + i, gen));
+			mt_errors++;
+			return;
+		}
+	}
+}
+
+/* Bytes of page I that are inside the file. */
+static
+size_t
+mt_pagelen(unsigned i)
+{
+	off_t off = (off_t)i * PAGE_SIZE;
+
+	if (off + PAGE_SIZE > MT_SIZE) {
+		return MT_SIZE - off;
+	}
+	return PAGE_SIZE;
+}
+
+/* Write LEN bytes of step GEN at OFF in the file. */
+static
+int
+mt_filewrite(struct vnode *v, char *buf, off_t off, size_t len, int gen)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	mt_fill(buf, off, len, gen);
+	uio_kinit(&iov, &ku, buf, len, off, UIO_WRITE);
+	result = VOP_WRITE(v, &ku);
+	if (result) {
+		kprintf("mmaptest: write: %s\n", strerror(result));
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("mmaptest: short write\n");
+		return EIO;
+	}
+	return 0;
+}
+
+/* Check that the LEN bytes at OFF in the file are from step GEN. */
+static
+int
+mt_fileread(struct vnode *v, char *buf, off_t off, size_t len, int gen)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, buf, len, off, UIO_READ);
+	result = VOP_READ(v, &ku);
+	if (result) {
+		kprintf("mmaptest: read: %s\n", strerror(result));
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("mmaptest: short read\n");
+		return EIO;
+	}
+	mt_check("file", buf, off, len, gen);
+	return 0;
+}
+
+/*
+ * Check that page I of the mapping at BASE holds step GEN of the file
+ * up to EOF, and zeros after.
+ */
+static
+int
+mt_mapread(const char *what, vaddr_t base, unsigned i, char *buf, int gen)
+{
+	off_t off = (off_t)i * PAGE_SIZE;
+	size_t len = mt_pagelen(i);
+	int result;
+
+	result = copyin((const_userptr_t)(base + i * PAGE_SIZE), buf,
+			PAGE_SIZE);
+	if (result) {
+		kprintf("mmaptest: %s: copyin: %s\n", what, strerror(result));
+		return result;
+	}
+	mt_check(what, buf, off, len, gen);
+	mt_check(what, buf + len, off + len, PAGE_SIZE - len, -1);
+	return 0;
+}
+
+/* Write step GEN over page I of the mapping at BASE, up to EOF. */
+static
+int
+mt_mapwrite(const char *what, vaddr_t base, unsigned i, char *buf, int gen)
+{
+	off_t off = (off_t)i * PAGE_SIZE;
+	size_t len = mt_pagelen(i);
+	int result;
+
+	mt_fill(buf, off, len, gen);
+	result = copyout(buf, (userptr_t)(base + i * PAGE_SIZE), len);
+	if (result) {
+		kprintf("mmaptest: %s: copyout: %s\n", what,
+			strerror(result));
+	}
+	return result;
+}
+
+static
+int
+domaptest(struct vnode *v, struct addrspace *as, char *buf)
+{
+	struct stat st;
+	vaddr_t sva, pva;
+	unsigned i;
+	int result;
+
+	for (i=0; i<MT_PAGES; i++) {
+		result = mt_filewrite(v, buf, (off_t)i * PAGE_SIZE,
+				      mt_pagelen(i), 0);
+		if (result) {
+			return result;
+		}
+	}
+
+	result = as_mmap(as, &sva, MT_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, v, 0);
+	if (result) {
+		kprintf("mmaptest: shared mmap: %s\n", strerror(result));
+		return result;
+	}
+	result = as_mmap(as, &pva, MT_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE, v, 0);
+	if (result) {
+		kprintf("mmaptest: private mmap: %s\n", strerror(result));
+		return result;
+	}
+
+	/* Both mappings show the file. */
+	for (i=0; i<MT_PAGES; i++) {
+		result = mt_mapread("shared", sva, i, buf, 0);
+		if (result) {
+			return result;
+		}
+		result = mt_mapread("private", pva, i, buf, 0);
+		if (result) {
+			return result;
+		}
+	}
+
+	/* A private write gets its own copy of the page. */
+	result = mt_mapwrite("private", pva, 0, buf, 1);
+	if (result) {
+		return result;
+	}
+	result = mt_mapread("private after private write", pva, 0, buf, 1);
+	if (result) {
+		return result;
+	}
+	result = mt_mapread("shared after private write", sva, 0, buf, 0);
+	if (result) {
+		return result;
+	}
+
+	/* Shared writes go to the cached page, not the private copy. */
+	for (i=0; i<2; i++) {
+		result = mt_mapwrite("shared", sva, i, buf, 2);
+		if (result) {
+			return result;
+		}
+		result = mt_mapread("shared after shared write", sva, i,
+				    buf, 2);
+		if (result) {
+			return result;
+		}
+	}
+	result = mt_mapread("private after shared write", pva, 0, buf, 1);
+	if (result) {
+		return result;
+	}
+
+	/* VOP_FSYNC writes back the shared pages, and only those. */
+	result = VOP_FSYNC(v);
+	if (result) {
+		kprintf("mmaptest: fsync: %s\n", strerror(result));
+		return result;
+	}
+	for (i=0; i<MT_PAGES; i++) {
+		result = mt_fileread(v, buf, (off_t)i * PAGE_SIZE,
+				     mt_pagelen(i), i < 2 ? 2 : 0);
+		if (result) {
+			return result;
+		}
+	}
+
+	/* So does the last munmap; the part past EOF is dropped. */
+	result = mt_mapwrite("shared", sva, 2, buf, 3);
+	if (result) {
+		return result;
+	}
+	result = as_munmap(as, pva, MT_SIZE);
+	if (result) {
+		kprintf("mmaptest: private munmap: %s\n", strerror(result));
+		return result;
+	}
+	result = as_munmap(as, sva, MT_SIZE);
+	if (result) {
+		kprintf("mmaptest: shared munmap: %s\n", strerror(result));
+		return result;
+	}
+	result = mt_fileread(v, buf, 2 * PAGE_SIZE, mt_pagelen(2), 3);
+	if (result) {
+		return result;
+	}
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		kprintf("mmaptest: stat: %s\n", strerror(result));
+		return result;
+	}
+	if (st.st_size != MT_SIZE) {
+		kprintf("mmaptest: file size is %llu, expected %u\n",
+			st.st_size, MT_SIZE);
+		mt_errors++;
+	}
+	return 0;
+}
+
+int
+mmaptest(int nargs, char **args)
+{
+	char name[64], path[64];
+	struct vnode *v;
+	struct addrspace *as, *oldas;
+	char *fs, *buf;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: mm1 filesystem:\n");
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) colon after device name */
+	fs = args[1];
+	if (fs[strlen(fs)-1]==':') {
+		fs[strlen(fs)-1] = 0;
+	}
+	snprintf(name, sizeof(name), "%s:%s", fs, FILENAME);
+
+	buf = kmalloc(PAGE_SIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	as = as_create();
+	if (as == NULL) {
+		kfree(buf);
+		return ENOMEM;
+	}
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(path, name);
+	result = vfs_open(path, O_RDWR | O_CREAT | O_TRUNC, 0664, &v);
+	if (result) {
+		kprintf("mmaptest: Could not open %s: %s\n", name,
+			strerror(result));
+		as_destroy(as);
+		kfree(buf);
+		return result;
+	}
+
+	kprintf("Starting mmap test...\n");
+	mt_errors = 0;
+
+	oldas = curproc_setas(as);
+	KASSERT(oldas == NULL);
+	as_activate();
+
+	result = as_prepare_load(as);
+	if (result == 0) {
+		result = as_complete_load(as);
+	}
+	if (result == 0) {
+		result = domaptest(v, as, buf);
+	}
+
+	curproc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+
+	vfs_close(v);
+	strcpy(path, name);
+	vfs_remove(path);
+	kfree(buf);
+
+	if (result) {
+		kprintf("mmap test failed: %s\n", strerror(result));
+		return result;
+	}
+	if (mt_errors > 0) {
+		kprintf("mmap test failed: %d errors\n", mt_errors);
+		return EIO;
+	}
+	kprintf("mmap test done.\n");
+	return 0;
+}
@@ -32,8 +32,10 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
+#include <spinlock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -41,6 +43,8 @@
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
+#define NRWLOOPS      120
+#define NRWBENCHLOOPS 200
 #define NTHREADS      32
 
 static volatile unsigned long testval1;
@@ -347,3 +351,266 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock tests. These make their own lock and semaphore
+ * rather than share the ones above, so they can clean up after
+ * themselves.
+ */
+
+static struct rwlock *testrw;
+static struct semaphore *rwdonesem;
+static struct spinlock rwcount_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned rwreaders;	/* readers inside right now */
+static volatile unsigned rwmaxreaders;	/* most ever inside at once */
+static volatile bool rwwriting;
+static volatile unsigned rwfailures;
+
+static
+void
+rwinit(const char *what)
+{
+	testrw = rwlock_create("testrw");
+	rwdonesem = sem_create("rwdonesem", 0);
+	if (testrw == NULL || rwdonesem == NULL) {
+		panic("%s: out of memory\n", what);
+	}
+}
+
+static
+void
+rwcleanup(void)
+{
+	rwlock_destroy(testrw);
+	sem_destroy(rwdonesem);
+	testrw = NULL;
+	rwdonesem = NULL;
+}
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	spinlock_acquire(&rwcount_lock);
+	rwfailures++;
+	spinlock_release(&rwcount_lock);
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+	bool writer;
+
+	(void)junk;
+
+	/* One thread in four writes. */
+	writer = (num % 4 == 0);
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (writer) {
+			rwlock_acquire_write(testrw);
+			if (rwreaders != 0 || rwwriting) {
+				rwfail(num, "writer not alone");
+			}
+			rwwriting = true;
+			testval1 = num;
+			for (j=0; j<100; j++);
+			testval2 = num*num;
+			testval3 = num%3;
+			if (testval1 != num) {
+				rwfail(num, "testval1 changed under writer");
+			}
+			rwwriting = false;
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			spinlock_acquire(&rwcount_lock);
+			rwreaders++;
+			if (rwreaders > rwmaxreaders) {
+				rwmaxreaders = rwreaders;
+			}
+			spinlock_release(&rwcount_lock);
+
+			if (rwwriting) {
+				rwfail(num, "reader with a writer inside");
+			}
+			if (testval2 != testval1*testval1 ||
+			    testval3 != testval1%3) {
+				rwfail(num, "inconsistent testvals");
+			}
+			for (j=0; j<100; j++);
+
+			spinlock_acquire(&rwcount_lock);
+			rwreaders--;
+			spinlock_release(&rwcount_lock);
+			rwlock_release_read(testrw);
+		}
+	}
+	V(rwdonesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	rwinit("rwtest");
+	rwreaders = 0;
+	rwmaxreaders = 0;
+	rwwriting = false;
+	rwfailures = 0;
+	testval1 = 0;
+	testval2 = 0;
+	testval3 = 0;
+
+	kprintf("Starting rwlock test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(rwdonesem);
+	}
+
+	rwcleanup();
+	kprintf("Up to %u readers held the lock at once.\n", rwmaxreaders);
+	if (rwfailures > 0) {
+		kprintf("Test failed: %u errors\n", rwfailures);
+		return EIO;
+	}
+	kprintf("Rwlock test done.\n");
+
+	return 0;
+}
+
+/*
+ * Throughput benchmark: NTHREADS threads hammer a read-mostly critical
+ * section, first under a plain lock and then under a rwlock. The
+ * argument is the percentage of operations that write (default 10).
+ */
+
+static struct lock *rwbenchlock;
+static volatile bool rwbench_uselock;
+static volatile unsigned rwbench_writepct;
+
+static
+void
+rwbenchthread(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+	bool write;
+
+	(void)junk;
+
+	for (i=0; i<NRWBENCHLOOPS; i++) {
+		write = (i * NTHREADS + num) % 100 < rwbench_writepct;
+
+		if (rwbench_uselock) {
+			lock_acquire(rwbenchlock);
+		}
+		else if (write) {
+			rwlock_acquire_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+		}
+
+		for (j=0; j<200; j++);
+		if (write) {
+			testval1++;
+		}
+
+		if (rwbench_uselock) {
+			lock_release(rwbenchlock);
+		}
+		else if (write) {
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_release_read(testrw);
+		}
+	}
+	V(rwdonesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+static
+uint64_t
+rwbench_run(bool uselock)
+{
+	uint64_t start;
+	int i, result;
+
+	rwbench_uselock = uselock;
+	start = clock_nsecs();
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwbench", NULL, rwbenchthread, NULL, i);
+		if (result) {
+			panic("rwbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(rwdonesem);
+	}
+	return clock_nsecs() - start;
+}
+
+int
+rwbench(int nargs, char **args)
+{
+	uint64_t locktime, rwtime;
+	unsigned ops;
+
+	rwbench_writepct = 10;
+	if (nargs > 1) {
+		rwbench_writepct = atoi(args[1]);
+	}
+	if (rwbench_writepct > 100) {
+		kprintf("Usage: sy5 [write-percent]\n");
+		return EINVAL;
+	}
+
+	rwinit("rwbench");
+	rwbenchlock = lock_create("rwbench");
+	if (rwbenchlock == NULL) {
+		panic("rwbench: out of memory\n");
+	}
+
+	ops = NTHREADS * NRWBENCHLOOPS;
+	kprintf("Starting rwlock benchmark: %d threads, %u ops, %u%% writes\n",
+		NTHREADS, ops, rwbench_writepct);
+
+	locktime = rwbench_run(true);
+	rwtime = rwbench_run(false);
+
+	lock_destroy(rwbenchlock);
+	rwbenchlock = NULL;
+	rwcleanup();
+
+	kprintf("lock:   %llu us (%llu ops/ms)\n",
+		locktime / 1000, (uint64_t)ops * 1000000 / (locktime + 1));
+	kprintf("rwlock: %llu us (%llu ops/ms)\n",
+		rwtime / 1000, (uint64_t)ops * 1000000 / (rwtime + 1));
+	kprintf("Rwlock benchmark done.\n");
+
+	return 0;
+}
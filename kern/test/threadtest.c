@@ -31,9 +31,14 @@
  * Thread test code.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <cpu.h>
+#include <current.h>
+#include <spinlock.h>
 #include <thread.h>
 #include <synch.h>
+#include <clock.h>
 #include <test.h>
 
 #define NTHREADS  8
@@ -144,3 +149,226 @@ threadtest2(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Affinity test. Each thread pins itself to every cpu in turn, a few
+ * times over, and checks it is running there afterwards, then checks
+ * that a mask with no cpus is refused. The first thread runs alone, so
+ * the cpus it leaves usually have nothing else to run. Any failure
+ * panics.
+ */
+static
+void
+affinitythread(void *junk, unsigned long num)
+{
+	unsigned i, j, c, ncpus;
+	int result;
+
+	(void)junk;
+
+	ncpus = cpu_count();
+	for (i=0; i<3*ncpus; i++) {
+		c = (num + i) % ncpus;
+		result = thread_setaffinity(1U << c);
+		if (result) {
+			panic("affinitytest: setaffinity to cpu %u: %s\n",
+			      c, strerror(result));
+		}
+		/* Run a little so there's a chance to be moved wrongly. */
+		for (j=0; j<10; j++) {
+			thread_yield();
+			if (curcpu->c_number != c) {
+				panic("affinitytest: thread %lu pinned to "
+				      "cpu %u is on cpu %u\n",
+				      num, c, curcpu->c_number);
+			}
+		}
+	}
+
+	if (thread_setaffinity(0) != EINVAL) {
+		panic("affinitytest: mask with no cpus accepted\n");
+	}
+
+	V(tsem);
+}
+
+int
+threadtest4(int nargs, char **args)
+{
+	char name[16];
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	init_sem();
+	kprintf("Starting affinity test on %u cpus...\n", cpu_count());
+
+	/* First alone, then all together. */
+	result = thread_fork("affinity0", NULL, affinitythread, NULL, 0);
+	if (result) {
+		panic("affinitytest: thread_fork failed %s)\n",
+		      strerror(result));
+	}
+	P(tsem);
+
+	for (i=0; i<NTHREADS; i++) {
+		snprintf(name, sizeof(name), "affinity%d", i);
+		result = thread_fork(name, NULL, affinitythread, NULL, i);
+		if (result) {
+			panic("affinitytest: thread_fork failed %s)\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(tsem);
+	}
+
+	kprintf("Affinity test done.\n");
+	return 0;
+}
+
+/*
+ * Nanosleep test. Checks that clocknanosleep sleeps at least as long
+ * as asked and not much longer, for intervals well under a clock tick
+ * as well as over a second, first alone and then with several threads
+ * sleeping at once (so they share nap channels). Then checks that
+ * timeouts set out of order run in deadline order and never early.
+ * Any failure panics.
+ */
+
+#define NS_USEC		1000ULL
+#define NS_MSEC		1000000ULL
+#define NS_SEC		1000000000ULL
+
+/*
+ * How late a sleep may end, alone and with other threads about: a few
+ * hardclock periods, since the wakeup can wait behind other threads'
+ * quanta. That still catches sleeps rounded to whole seconds.
+ */
+#define NS_HARDCLOCK	(NS_SEC / HZ)
+#define NS_SLACK	(4 * NS_HARDCLOCK)
+#define NS_BUSYSLACK	(16 * NS_HARDCLOCK)
+
+static const uint64_t nanotimes[] = {
+	10 * NS_USEC,
+	100 * NS_USEC,
+	NS_MSEC,
+	3 * NS_MSEC,
+	25 * NS_MSEC,
+};
+#define NNANOTIMES (sizeof(nanotimes) / sizeof(nanotimes[0]))
+
+static
+void
+nanocheck(uint64_t nsecs, uint64_t slack)
+{
+	uint64_t start, elapsed;
+	int result;
+
+	start = clock_nsecs();
+	result = clocknanosleep(nsecs);
+	elapsed = clock_nsecs() - start;
+	if (result) {
+		panic("nanotest: clocknanosleep: %s\n", strerror(result));
+	}
+	if (elapsed < nsecs || elapsed > nsecs + slack) {
+		panic("nanotest: asked for %llu ns, woke after %llu\n",
+		      nsecs, elapsed);
+	}
+}
+
+static
+void
+nanothread(void *junk, unsigned long num)
+{
+	unsigned i, j;
+
+	(void)junk;
+
+	for (i=0; i<4; i++) {
+		for (j=0; j<NNANOTIMES; j++) {
+			nanocheck(nanotimes[(j + num) % NNANOTIMES],
+				  NS_BUSYSLACK);
+		}
+	}
+	V(tsem);
+}
+
+struct nanotimeout {
+	struct timeout nt_to;
+	unsigned nt_rank;		/* expected place in firing order */
+};
+
+static struct spinlock nanolock = SPINLOCK_INITIALIZER;
+static unsigned nanofired;
+
+static
+void
+nanotimeout(void *data)
+{
+	struct nanotimeout *nt = data;
+
+	if (clock_nsecs() < nt->nt_to.to_when) {
+		panic("nanotest: timeout %u ran early\n", nt->nt_rank);
+	}
+	spinlock_acquire(&nanolock);
+	if (nanofired != nt->nt_rank) {
+		panic("nanotest: timeout %u ran in place %u\n",
+		      nt->nt_rank, nanofired);
+	}
+	nanofired++;
+	spinlock_release(&nanolock);
+	V(tsem);
+}
+
+int
+threadtest5(int nargs, char **args)
+{
+	static const unsigned ranks[] = { 2, 0, 3, 1 };
+	struct nanotimeout nts[4];
+	uint64_t now;
+	unsigned i;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	init_sem();
+	kprintf("Starting nanosleep test...\n");
+
+	for (i=0; i<NNANOTIMES; i++) {
+		nanocheck(nanotimes[i], NS_SLACK);
+	}
+	nanocheck(2 * NS_SEC, NS_SLACK);
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("nanotest", NULL, nanothread, NULL, i);
+		if (result) {
+			panic("nanotest: thread_fork failed %s)\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(tsem);
+	}
+
+	nanofired = 0;
+	now = clock_nsecs();
+	for (i=0; i<4; i++) {
+		nts[i].nt_rank = ranks[i];
+		result = timeout_set(&nts[i].nt_to,
+				     now + (ranks[i] + 1) * NS_MSEC,
+				     nanotimeout, &nts[i]);
+		if (result) {
+			panic("nanotest: timeout_set: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<4; i++) {
+		P(tsem);
+	}
+
+	kprintf("Nanosleep test done.\n");
+	return 0;
+}
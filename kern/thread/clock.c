@@ -28,8 +28,10 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
@@ -39,9 +41,12 @@
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * Kernel timeouts are kept in a min-heap ordered by deadline. The
+ * timer device (ltimer) is used as a one-shot alarm: it is always
+ * programmed for the earliest pending deadline, or TIMERCLOCK_IDLE if
+ * there is none, rather than interrupting every LT_GRANULARITY. Its
+ * interrupt calls timerclock(), which runs the expired timeouts and
+ * programs the next alarm.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -54,58 +59,250 @@
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
+#define TIMERCLOCK_IDLE		1000000	/* Alarm (usec) with nothing pending */
+#define TIMERCLOCK_MIN		10	/* Shortest alarm (usec) */
+#define TIMEOUT_INITIAL		32	/* Initial heap size */
+
+/* The alarm device, registered by timerclock_attach. */
+static void *alarm_devdata;
+static void (*alarm_set)(void *devdata, uint32_t usecs);
+
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Pending timeouts. The heap is only grown with timeout_lock released,
+ * since kmalloc can't be called with a spinlock held.
  */
-static struct wchan *lbolt;
+static struct spinlock timeout_lock = SPINLOCK_INITIALIZER;
+static struct timeout **timeout_heap;
+static unsigned timeout_num, timeout_max;
+
 /*
- * Once every LT_GRANULARITY usec, everything on minibolt is awakenened by CPU 0
+ * Sleeping threads wait on one of these, chosen by thread, to be
+ * woken by their timeout.
  */
-static struct wchan *minibolt;
+#define NAPCHANS 8
+static struct wchan *napchans[NAPCHANS];
 
-/* 
- * number of minibolts per second
+struct nap {
+	struct wchan *n_chan;
+	bool n_done;			/* protected by n_chan's lock */
+};
+
+/*
+ * Setup.
  */
-#define MINI_PER_SECOND (1000000/LT_GRANULARITY);
+void
+hardclock_bootstrap(void)
+{
+	unsigned i;
+
+	for (i = 0; i < NAPCHANS; i++) {
+		napchans[i] = wchan_create("nap");
+		if (napchans[i] == NULL) {
+			panic("Couldn't create nap channels\n");
+		}
+	}
+	timeout_heap = kmalloc(TIMEOUT_INITIAL * sizeof(struct timeout *));
+	if (timeout_heap == NULL) {
+		panic("Couldn't allocate timeout heap\n");
+	}
+	timeout_num = 0;
+	timeout_max = TIMEOUT_INITIAL;
+}
+
+void
+timerclock_attach(void *devdata, void (*setalarm)(void *, uint32_t))
+{
+	KASSERT(alarm_set == NULL);
+	alarm_devdata = devdata;
+	alarm_set = setalarm;
+}
+
+uint64_t
+clock_nsecs(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
 
 /*
- * minibolt countdown
+ * Heap operations. The caller holds timeout_lock.
  */
-static int minicount;
+static
+void
+timeout_place(struct timeout *to, unsigned i)
+{
+	timeout_heap[i] = to;
+	to->to_index = i;
+}
+
+static
+void
+timeout_up(unsigned i)
+{
+	struct timeout *to = timeout_heap[i];
+
+	while (i > 0 && timeout_heap[(i - 1) / 2]->to_when > to->to_when) {
+		timeout_place(timeout_heap[(i - 1) / 2], i);
+		i = (i - 1) / 2;
+	}
+	timeout_place(to, i);
+}
+
+static
+void
+timeout_down(unsigned i)
+{
+	struct timeout *to = timeout_heap[i];
+	unsigned child;
+
+	while ((child = 2 * i + 1) < timeout_num) {
+		if (child + 1 < timeout_num &&
+		    timeout_heap[child + 1]->to_when <
+		    timeout_heap[child]->to_when) {
+			child++;
+		}
+		if (timeout_heap[child]->to_when >= to->to_when) {
+			break;
+		}
+		timeout_place(timeout_heap[child], i);
+		i = child;
+	}
+	timeout_place(to, i);
+}
+
+/* Remove and return the earliest timeout. */
+static
+struct timeout *
+timeout_pop(void)
+{
+	struct timeout *to;
+
+	KASSERT(timeout_num > 0);
+	to = timeout_heap[0];
+	timeout_num--;
+	if (timeout_num > 0) {
+		timeout_place(timeout_heap[timeout_num], 0);
+		timeout_down(0);
+	}
+	to->to_index = -1;
+	return to;
+}
 
 /*
- * Setup.
+ * Program the alarm for the earliest deadline. The caller holds
+ * timeout_lock. NOW is only looked at if something is pending.
  */
+static
 void
-hardclock_bootstrap(void)
+timeout_program(uint64_t now)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	uint64_t when, usecs;
+
+	if (alarm_set == NULL) {
+		return;
+	}
+	if (timeout_num == 0) {
+		usecs = TIMERCLOCK_IDLE;
 	}
-	minibolt = wchan_create("minibolt");
-	if (minibolt == NULL) {
-		panic("Couldn't create minibolt\n");
+	else {
+		when = timeout_heap[0]->to_when;
+		usecs = when > now ? (when - now + 999) / 1000 : 0;
+		if (usecs < TIMERCLOCK_MIN) {
+			usecs = TIMERCLOCK_MIN;
+		}
+		if (usecs > TIMERCLOCK_IDLE) {
+			usecs = TIMERCLOCK_IDLE;
+		}
 	}
-	minicount = MINI_PER_SECOND;
-	/* we assume MINI_PER_SECOND > 0 */
-	KASSERT(minicount > 0);
+	alarm_set(alarm_devdata, usecs);
+}
+
+int
+timeout_set(struct timeout *to, uint64_t when,
+	    void (*func)(void *), void *data)
+{
+	struct timeout **newheap, **oldheap;
+	unsigned max;
+	uint64_t now;
+
+	KASSERT(alarm_set != NULL);
+
+	to->to_when = when;
+	to->to_func = func;
+	to->to_data = data;
+	now = clock_nsecs();
+
+	spinlock_acquire(&timeout_lock);
+	while (timeout_num == timeout_max) {
+		max = timeout_max;
+		spinlock_release(&timeout_lock);
+
+		newheap = kmalloc(2 * max * sizeof(struct timeout *));
+		if (newheap == NULL) {
+			return ENOMEM;
+		}
+
+		spinlock_acquire(&timeout_lock);
+		oldheap = newheap;
+		if (timeout_max == max) {
+			memcpy(newheap, timeout_heap,
+			       timeout_num * sizeof(struct timeout *));
+			oldheap = timeout_heap;
+			timeout_heap = newheap;
+			timeout_max = 2 * max;
+		}
+		/* else somebody else grew it meanwhile; drop ours */
+		spinlock_release(&timeout_lock);
+		kfree(oldheap);
+		spinlock_acquire(&timeout_lock);
+	}
+
+	timeout_place(to, timeout_num);
+	timeout_num++;
+	timeout_up(to->to_index);
+	if (to->to_index == 0) {
+		/* New earliest deadline; bring the alarm forward. */
+		timeout_program(now);
+	}
+	spinlock_release(&timeout_lock);
+	return 0;
 }
 
 /*
- * This is called once every every LT_GRANULARITY usec, on one processor,
- * by the timer code.
+ * This is called on one processor by the timer code, whenever the
+ * alarm set by timeout_program goes off.
  */
 void
 timerclock(void)
 {
-	/* Broadcast on minibolt */
-	wchan_wakeall(minibolt);
-	/* Broadcast on lbolt if a second has elapsed */
-	if (--minicount <= 0) {
-	  minicount = MINI_PER_SECOND;
-	  wchan_wakeall(lbolt);
+	struct timeout *to;
+	void (*func)(void *);
+	void *data;
+	uint64_t now;
+
+	spinlock_acquire(&timeout_lock);
+	if (timeout_num == 0) {
+		/* Don't touch the clock; it may not be attached yet. */
+		timeout_program(0);
+		spinlock_release(&timeout_lock);
+		return;
 	}
+
+	now = clock_nsecs();
+	while (timeout_num > 0 && timeout_heap[0]->to_when <= now) {
+		to = timeout_pop();
+		func = to->to_func;
+		data = to->to_data;
+		/* TO may be gone as soon as FUNC has run. */
+		spinlock_release(&timeout_lock);
+		func(data);
+		spinlock_acquire(&timeout_lock);
+	}
+	timeout_program(now);
+	spinlock_release(&timeout_lock);
 }
 
 /*
@@ -126,7 +323,57 @@ hardclock(void)
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
-	thread_yield();
+	thread_preempt();
+}
+
+/* Timeout function for clocknanosleep. */
+static
+void
+clock_wake(void *data)
+{
+	struct nap *nap = data;
+	struct wchan *chan = nap->n_chan;
+
+	/*
+	 * NAP is on the sleeper's stack, and the sleeper may see
+	 * n_done and return (even without sleeping, since napchans
+	 * are shared) as soon as we unlock; don't touch it after that.
+	 */
+	wchan_lock(chan);
+	nap->n_done = true;
+	wchan_unlock(chan);
+	wchan_wakeall(chan);
+}
+
+int
+clocknanosleep(uint64_t nsecs)
+{
+	struct timeout to;
+	struct nap nap;
+	uint64_t now;
+	int result;
+
+	nap.n_chan = napchans[((uintptr_t)curthread / sizeof(struct thread))
+			      % NAPCHANS];
+	nap.n_done = false;
+
+	now = clock_nsecs();
+	if (nsecs > ~(uint64_t)0 - now) {
+		/* Saturate rather than wrap into the past. */
+		nsecs = ~(uint64_t)0 - now;
+	}
+	result = timeout_set(&to, now + nsecs, clock_wake, &nap);
+	if (result) {
+		return result;
+	}
+
+	wchan_lock(nap.n_chan);
+	while (!nap.n_done) {
+		wchan_sleep(nap.n_chan);
+		wchan_lock(nap.n_chan);
+	}
+	wchan_unlock(nap.n_chan);
+	return 0;
 }
 
 /*
@@ -135,10 +382,8 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-  while (num_secs > 0) {
-    wchan_lock(lbolt);
-    wchan_sleep(lbolt);
-    num_secs--;
+  if (num_secs > 0) {
+    (void)clocknanosleep((uint64_t)num_secs * 1000000000);
   }
 }
 
@@ -149,9 +394,7 @@ clocksleep(int num_secs)
 void
 clocknap(int num_ticks)
 {
-  while (num_ticks > 0) {
-    wchan_lock(minibolt);
-    wchan_sleep(minibolt);
-    num_ticks--;
+  if (num_ticks > 0) {
+    (void)clocknanosleep((uint64_t)num_ticks * LT_GRANULARITY * 1000);
   }
 }
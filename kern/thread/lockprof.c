@@ -0,0 +1,228 @@
+/*
+ * Lock contention profiler. See lockprof.h.
+ *
+ * The table is a fixed array hashed on the key, so that recording
+ * never needs to allocate; once it is full, new keys are only
+ * counted in lockprof_dropped. It is protected by a bare test-and-set
+ * word rather than a struct spinlock, because spinlock_release itself
+ * reports here.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <lockprof.h>
+
+#define LOCKPROF_SIZE		128	/* must be a power of 2 */
+#define LOCKPROF_NAMELEN	24
+
+struct lockprof_entry {
+	bool lp_used;
+	unsigned lp_kind;
+	const void *lp_site;		/* LOCKPROF_SPIN */
+	char lp_name[LOCKPROF_NAMELEN];	/* the others; may be truncated */
+	unsigned lp_acquires;
+	unsigned lp_contended;
+	uint64_t lp_wait;
+	uint64_t lp_holdmax;
+};
+
+static volatile spinlock_data_t lockprof_lock = SPINLOCK_DATA_INITIALIZER;
+static struct lockprof_entry lockprof_table[LOCKPROF_SIZE];
+static unsigned lockprof_dropped;
+static volatile bool lockprof_timing = false;
+
+/* Copy of the table for printing; lockprof_print is not reentrant. */
+static struct lockprof_entry lockprof_snap[LOCKPROF_SIZE];
+
+void
+lockprof_bootstrap(void)
+{
+	lockprof_timing = true;
+}
+
+uint64_t
+lockprof_now(void)
+{
+	return lockprof_timing ? clock_nsecs() : 0;
+}
+
+/*
+ * Does the entry's name match NAME, allowing for the entry's copy
+ * having been cut short?
+ */
+static
+bool
+lockprof_samename(const char *ename, const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < LOCKPROF_NAMELEN - 1; i++) {
+		if (ename[i] != name[i]) {
+			return false;
+		}
+		if (name[i] == 0) {
+			return true;
+		}
+	}
+	return true;
+}
+
+static
+unsigned
+lockprof_hash(unsigned kind, const void *site, const char *name)
+{
+	unsigned h, i;
+
+	if (kind == LOCKPROF_SPIN) {
+		return ((uintptr_t)site >> 2) * 2654435761U;
+	}
+	h = kind;
+	for (i = 0; i < LOCKPROF_NAMELEN - 1 && name[i] != 0; i++) {
+		h = h * 33 + (unsigned char)name[i];
+	}
+	return h;
+}
+
+/*
+ * Find or make the entry for a key. The caller holds lockprof_lock.
+ * Returns NULL if the table is full.
+ */
+static
+struct lockprof_entry *
+lockprof_find(unsigned kind, const void *site, const char *name)
+{
+	struct lockprof_entry *lp;
+	unsigned h, i, j;
+
+	h = lockprof_hash(kind, site, name);
+	for (i = 0; i < LOCKPROF_SIZE; i++) {
+		lp = &lockprof_table[(h + i) & (LOCKPROF_SIZE - 1)];
+		if (!lp->lp_used) {
+			lp->lp_used = true;
+			lp->lp_kind = kind;
+			lp->lp_site = site;
+			for (j = 0; name != NULL && name[j] != 0 &&
+				    j < LOCKPROF_NAMELEN - 1; j++) {
+				lp->lp_name[j] = name[j];
+			}
+			lp->lp_name[j] = 0;
+			return lp;
+		}
+		if (lp->lp_kind != kind) {
+			continue;
+		}
+		if (kind == LOCKPROF_SPIN ? lp->lp_site == site :
+		    lockprof_samename(lp->lp_name, name)) {
+			return lp;
+		}
+	}
+	return NULL;
+}
+
+void
+lockprof_record(unsigned kind, const void *site, const char *name,
+		bool contended, uint64_t wait, uint64_t hold)
+{
+	struct lockprof_entry *lp;
+
+	splraise(IPL_NONE, IPL_HIGH);
+	while (spinlock_data_testandset(&lockprof_lock) != 0) {
+		/* nothing */
+	}
+
+	lp = lockprof_find(kind, site, name);
+	if (lp == NULL) {
+		lockprof_dropped++;
+	}
+	else {
+		lp->lp_acquires++;
+		if (contended) {
+			lp->lp_contended++;
+			lp->lp_wait += wait;
+		}
+		if (hold > lp->lp_holdmax) {
+			lp->lp_holdmax = hold;
+		}
+	}
+
+	spinlock_data_set(&lockprof_lock, 0);
+	spllower(IPL_HIGH, IPL_NONE);
+}
+
+/*
+ * Print the entries of one kind from the snapshot. DIV scales the
+ * times for printing.
+ */
+static
+void
+lockprof_printkind(unsigned num, unsigned kind, const char *title,
+		   const char *holdtitle, unsigned div)
+{
+	struct lockprof_entry *lp;
+	unsigned i;
+
+	kprintf("%-24s %9s %9s %12s %10s\n", title, "acquires",
+		"contended", "total wait", holdtitle);
+	for (i = 0; i < num; i++) {
+		lp = &lockprof_snap[i];
+		if (lp->lp_kind != kind) {
+			continue;
+		}
+		if (kind == LOCKPROF_SPIN) {
+			kprintf("  %-22p", lp->lp_site);
+		}
+		else {
+			kprintf("  %-22s", lp->lp_name);
+		}
+		kprintf(" %9u %9u %12llu %10llu\n", lp->lp_acquires,
+			lp->lp_contended, lp->lp_wait / div,
+			lp->lp_holdmax / div);
+	}
+}
+
+void
+lockprof_print(void)
+{
+	struct lockprof_entry tmp;
+	unsigned i, j, num, dropped;
+
+	/* Copy out and clear, then print without the lock. */
+	splraise(IPL_NONE, IPL_HIGH);
+	while (spinlock_data_testandset(&lockprof_lock) != 0) {
+		/* nothing */
+	}
+	num = 0;
+	for (i = 0; i < LOCKPROF_SIZE; i++) {
+		if (lockprof_table[i].lp_used) {
+			lockprof_snap[num++] = lockprof_table[i];
+		}
+	}
+	bzero(lockprof_table, sizeof(lockprof_table));
+	dropped = lockprof_dropped;
+	lockprof_dropped = 0;
+	spinlock_data_set(&lockprof_lock, 0);
+	spllower(IPL_HIGH, IPL_NONE);
+
+	/* Most total wait first; there are at most LOCKPROF_SIZE. */
+	for (i = 1; i < num; i++) {
+		tmp = lockprof_snap[i];
+		for (j = i; j > 0 && lockprof_snap[j-1].lp_wait < tmp.lp_wait;
+		     j--) {
+			lockprof_snap[j] = lockprof_snap[j-1];
+		}
+		lockprof_snap[j] = tmp;
+	}
+
+	lockprof_printkind(num, LOCKPROF_SPIN, "spinlocks by caller (cyc)",
+			   "max hold", 1);
+	lockprof_printkind(num, LOCKPROF_LOCK, "locks (usec)",
+			   "max hold", 1000);
+	lockprof_printkind(num, LOCKPROF_WCHAN, "wait channels (usec)",
+			   "max sleep", 1000);
+	if (dropped > 0) {
+		kprintf("(%u uses not counted: table full)\n", dropped);
+	}
+}
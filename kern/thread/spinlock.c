@@ -36,11 +36,21 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>	/* for curcpu */
+#if OPT_LOCKPROF
+#include <lockprof.h>
+#endif
 
 /*
  * Spinlocks.
  */
 
+/*
+ * Passes through the wait loop per CPU ahead of us in line between
+ * looks at lk_serving. Waiting in proportion to our place in line
+ * keeps the CPUs at the back from polling the lock word while they
+ * have no chance of getting it.
+ */
+#define SPINLOCK_BACKOFF	20
 
 /*
  * Initialize spinlock.
@@ -48,8 +58,23 @@
 void
 spinlock_init(struct spinlock *lk)
 {
-	spinlock_data_set(&lk->lk_lock, 0);
+	spinlock_data_set(&lk->lk_next, 0);
+	spinlock_data_set(&lk->lk_serving, 0);
 	lk->lk_holder = NULL;
+#if OPT_LOCKSTAT
+	lk->lk_acquires = 0;
+	lk->lk_contended = 0;
+	lk->lk_spins = 0;
+	lk->lk_holdtotal = 0;
+	lk->lk_holdmax = 0;
+	lk->lk_stamp = 0;
+#endif
+#if OPT_LOCKPROF
+	lk->lk_profsite = NULL;
+	lk->lk_profcontended = false;
+	lk->lk_profwait = 0;
+	lk->lk_profstamp = 0;
+#endif
 }
 
 /*
@@ -59,7 +84,8 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
-	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	KASSERT(spinlock_data_get(&lk->lk_next) ==
+		spinlock_data_get(&lk->lk_serving));
 }
 
 /*
@@ -67,12 +93,18 @@ spinlock_cleanup(struct spinlock *lk)
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
  * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * atomic operation to take a ticket and wait for our turn.
  */
 void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket, serving;
+	unsigned spins;
+	volatile unsigned i;
+#if OPT_LOCKPROF
+	uint32_t start;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,27 +119,42 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
+	/*
+	 * Fetch-and-add is a machine-level atomic operation, so every
+	 * CPU gets a different ticket. The lock is ours when
+	 * lk_serving comes round to it; spinlock_release advances
+	 * lk_serving by one, so waiters are served first come, first
+	 * served. Only the holder writes lk_serving, so while we wait
+	 * we just read it.
+	 */
+#if OPT_LOCKPROF
+	start = spinlock_cycles();
+#endif
+	ticket = spinlock_data_fetchadd(&lk->lk_next, 1);
+	spins = 0;
+	while ((serving = spinlock_data_get(&lk->lk_serving)) != ticket) {
+		for (i = (ticket - serving) * SPINLOCK_BACKOFF; i > 0; i--) {
+			spins++;
 		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
-		}
-		break;
 	}
 
 	lk->lk_holder = mycpu;
+#if OPT_LOCKSTAT
+	lk->lk_acquires++;
+	if (spins > 0) {
+		lk->lk_contended++;
+		lk->lk_spins += spins;
+	}
+	lk->lk_stamp = spinlock_cycles();
+#endif
+#if OPT_LOCKPROF
+	lk->lk_profsite = __builtin_return_address(0);
+	lk->lk_profcontended = spins > 0;
+	lk->lk_profstamp = spinlock_cycles();
+	lk->lk_profwait = lk->lk_profstamp >= start ?
+		lk->lk_profstamp - start : lk->lk_profstamp;
+#endif
+	(void)spins;
 }
 
 /*
@@ -116,13 +163,44 @@ spinlock_acquire(struct spinlock *lk)
 void
 spinlock_release(struct spinlock *lk)
 {
+#if OPT_LOCKSTAT || OPT_LOCKPROF
+	uint32_t now, held;
+#endif
+#if OPT_LOCKPROF
+	const void *site;
+	bool contended;
+	uint32_t wait;
+#endif
+
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKSTAT
+	/* c0_count wraps each tick; count only since then. */
+	now = spinlock_cycles();
+	held = now >= lk->lk_stamp ? now - lk->lk_stamp : now;
+	lk->lk_holdtotal += held;
+	if (held > lk->lk_holdmax) {
+		lk->lk_holdmax = held;
+	}
+#endif
+#if OPT_LOCKPROF
+	now = spinlock_cycles();
+	held = now >= lk->lk_profstamp ? now - lk->lk_profstamp : now;
+	site = lk->lk_profsite;
+	contended = lk->lk_profcontended;
+	wait = lk->lk_profwait;
+#endif
+
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+	spinlock_data_set(&lk->lk_serving,
+			  spinlock_data_get(&lk->lk_serving) + 1);
+#if OPT_LOCKPROF
+	/* Report after letting go, so as not to hold up the next CPU. */
+	lockprof_record(LOCKPROF_SPIN, site, NULL, contended, wait, held);
+#endif
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -139,3 +217,35 @@ spinlock_do_i_hold(struct spinlock *lk)
 	/* Assume we can read lk_holder atomically enough for this to work */
 	return (lk->lk_holder == curcpu->c_self);
 }
+
+#if OPT_LOCKSTAT
+/*
+ * Print and clear the lock's statistics. The figures are copied out
+ * with the lock held, so this acquire itself is counted afterwards.
+ */
+void
+spinlock_printstats(struct spinlock *lk, const char *name)
+{
+	unsigned acquires, contended;
+	uint64_t spins, holdtotal;
+	uint32_t holdmax;
+
+	spinlock_acquire(lk);
+	acquires = lk->lk_acquires;
+	contended = lk->lk_contended;
+	spins = lk->lk_spins;
+	holdtotal = lk->lk_holdtotal;
+	holdmax = lk->lk_holdmax;
+	lk->lk_acquires = 0;
+	lk->lk_contended = 0;
+	lk->lk_spins = 0;
+	lk->lk_holdtotal = 0;
+	lk->lk_holdmax = 0;
+	spinlock_release(lk);
+
+	kprintf("%-16s %8u acquires, %8u contended, %6llu spins/wait, "
+		"held %6llu avg %8u max cycles\n", name, acquires, contended,
+		contended ? spins / contended : 0ULL,
+		acquires ? holdtotal / acquires : 0ULL, holdmax);
+}
+#endif
@@ -39,6 +39,9 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#if OPT_LOCKPROF
+#include <lockprof.h>
+#endif
 
 ////////////////////////////////////////////////////////////
 //
@@ -175,6 +178,17 @@ lock_create(const char *name)
 	spinlock_init(&lock->lk_spin);
         lock->held = false;
         lock->owner = NULL;
+        lock->lk_waiters = 0;
+        lock->lk_handoff = false;
+        lock->lk_acquires = 0;
+        lock->lk_contended = 0;
+        lock->lk_spun = 0;
+        lock->lk_slept = 0;
+#if OPT_LOCKPROF
+        lock->lk_profcontended = false;
+        lock->lk_profwait = 0;
+        lock->lk_profstamp = 0;
+#endif
         
         return lock;
 }
@@ -192,26 +206,126 @@ lock_destroy(struct lock *lock)
         kfree(lock);
 }
 
+/* Most times lock_acquire checks on a running holder before sleeping. */
+#define LOCK_SPIN_MAX 1000
+
+/*
+ * Is the lock's holder running on some CPU right now? This looks at
+ * the holder without any lock, so the answer may be stale, and the
+ * thread may even have exited since; that only affects whether we
+ * spin a little longer.
+ */
+static
+bool
+lock_owner_running(struct lock *lock)
+{
+        struct thread *owner = lock->owner;
+
+        return owner != NULL &&
+                *(volatile threadstate_t *)&owner->t_state == S_RUN;
+}
+
+#if OPT_LOCKPROF
+/*
+ * Note, for the profiler, when we got the lock and how long we waited
+ * since START. Called by the new holder, so no lock is needed.
+ */
+static
+void
+lock_profacquired(struct lock *lock, bool contended, uint64_t start)
+{
+        lock->lk_profstamp = lockprof_now();
+        lock->lk_profcontended = contended;
+        lock->lk_profwait = start != 0 ? lock->lk_profstamp - start : 0;
+}
+#endif
+
 void
 lock_acquire(struct lock *lock)
 {
-        // Write this
+        unsigned spins;
+#if OPT_LOCKPROF
+        uint64_t start = lockprof_now();
+#endif
+
         KASSERT(lock != NULL);
         KASSERT(!(lock_do_i_hold(lock)));
         //For robustness, always check
         //KASSERT(curthread->t_in_interrupt == false);
 
+        spinlock_acquire(&(lock->lk_spin));
+        lock->lk_acquires++;
+        if (!lock->held) {
+                lock->held = true;
+                lock->owner = curthread;
+                spinlock_release(&(lock->lk_spin));
+#if OPT_LOCKPROF
+                lock_profacquired(lock, false, start);
+#endif
+                return;
+        }
+        lock->lk_contended++;
 
+        /* Spin, without the spinlock, while the holder is on a CPU. */
+        spinlock_release(&(lock->lk_spin));
+        for (spins = 0; spins < LOCK_SPIN_MAX; spins++) {
+                if (!lock->held || !lock_owner_running(lock)) {
+                        break;
+                }
+        }
         spinlock_acquire(&(lock->lk_spin));
-        while(lock->held) {
-                wchan_lock(lock->lk_wchan);
+        if (!lock->held) {
+                lock->lk_spun++;
+                lock->held = true;
+                lock->owner = curthread;
                 spinlock_release(&(lock->lk_spin));
-                wchan_sleep(lock->lk_wchan);
-                spinlock_acquire(&(lock->lk_spin));
+#if OPT_LOCKPROF
+                lock_profacquired(lock, true, start);
+#endif
+                return;
         }
-        lock->held = true;
+
+        /*
+         * Sleep. lock_release hands the lock over rather than freeing
+         * it when there are waiters, so once woken it is ours.
+         */
+        lock->lk_slept++;
+        lock->lk_waiters++;
+        wchan_lock(lock->lk_wchan);
+        spinlock_release(&(lock->lk_spin));
+        wchan_sleep(lock->lk_wchan);
+        spinlock_acquire(&(lock->lk_spin));
+        KASSERT(lock->held && lock->lk_handoff);
+        lock->lk_handoff = false;
         lock->owner = curthread;
         spinlock_release(&(lock->lk_spin));
+#if OPT_LOCKPROF
+        lock_profacquired(lock, true, start);
+#endif
+}
+
+bool
+lock_tryacquire(struct lock *lock)
+{
+        bool got;
+
+        KASSERT(lock != NULL);
+        KASSERT(!(lock_do_i_hold(lock)));
+
+        spinlock_acquire(&(lock->lk_spin));
+        got = !lock->held;
+        if (got) {
+                lock->lk_acquires++;
+                lock->held = true;
+                lock->owner = curthread;
+        }
+        spinlock_release(&(lock->lk_spin));
+#if OPT_LOCKPROF
+        if (got) {
+                lock_profacquired(lock, false, 0);
+        }
+#endif
+        return got;
 }
 
 void
@@ -221,12 +335,35 @@ lock_release(struct lock *lock)
         KASSERT(lock != NULL);
         KASSERT(lock_do_i_hold(lock));
 
+#if OPT_LOCKPROF
+        /*
+         * Report before letting go: once it's free, someone else may
+         * get it and destroy it, taking lk_name with it.
+         */
+        lockprof_record(LOCKPROF_LOCK, NULL, lock->lk_name,
+                        lock->lk_profcontended, lock->lk_profwait,
+                        lock->lk_profstamp != 0 ?
+                        lockprof_now() - lock->lk_profstamp : 0);
+#endif
+
 	spinlock_acquire(&(lock->lk_spin));
 
-        lock->held = false;
         lock->owner = NULL;
-        
-	wchan_wakeone(lock->lk_wchan);
+        if (lock->lk_waiters == 0) {
+                lock->held = false;
+        }
+        else {
+                /*
+                 * Hand off: leave it held so nobody can barge in
+                 * before the thread we wake gets to run. It counted
+                 * itself in lk_waiters with lk_spin held, and isn't
+                 * on the channel yet only if it still has the channel
+                 * locked, so wchan_wakeone will find it.
+                 */
+                lock->lk_waiters--;
+                lock->lk_handoff = true;
+                wchan_wakeone(lock->lk_wchan);
+        }
 
 	spinlock_release(&(lock->lk_spin));
 }
@@ -321,3 +458,171 @@ cv_broadcast(struct cv *cv, struct lock *lock)
         (void) lock;
 	wchan_wakeall(cv->cv_wchan);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+        struct rwlock *rw;
+
+        rw = kmalloc(sizeof(struct rwlock));
+        if (rw == NULL) {
+                return NULL;
+        }
+
+        rw->rwlock_name = kstrdup(name);
+        if (rw->rwlock_name == NULL) {
+                kfree(rw);
+                return NULL;
+        }
+
+        rw->rw_rwchan = wchan_create(rw->rwlock_name);
+        if (rw->rw_rwchan == NULL) {
+                kfree(rw->rwlock_name);
+                kfree(rw);
+                return NULL;
+        }
+        rw->rw_wwchan = wchan_create(rw->rwlock_name);
+        if (rw->rw_wwchan == NULL) {
+                wchan_destroy(rw->rw_rwchan);
+                kfree(rw->rwlock_name);
+                kfree(rw);
+                return NULL;
+        }
+
+        spinlock_init(&rw->rw_spin);
+        rw->rw_readers = 0;
+        rw->rw_writer = NULL;
+        rw->rw_rwaiting = 0;
+        rw->rw_wwaiting = 0;
+        rw->rw_handoff = false;
+
+        return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(rw->rw_readers == 0);
+        KASSERT(rw->rw_writer == NULL && !rw->rw_handoff);
+
+        spinlock_cleanup(&rw->rw_spin);
+        wchan_destroy(rw->rw_wwchan);
+        wchan_destroy(rw->rw_rwchan);
+        kfree(rw->rwlock_name);
+        kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+        KASSERT(rw->rw_writer != curthread);
+
+        spinlock_acquire(&rw->rw_spin);
+        if (rw->rw_writer == NULL && !rw->rw_handoff &&
+            rw->rw_wwaiting == 0) {
+                rw->rw_readers++;
+                spinlock_release(&rw->rw_spin);
+                return;
+        }
+
+        /*
+         * A writer has it or is waiting for it. Sleep until a writer
+         * lets our batch in; it counts us in rw_readers before waking
+         * us, as lock_release does for lock waiters.
+         */
+        rw->rw_rwaiting++;
+        wchan_lock(rw->rw_rwchan);
+        spinlock_release(&rw->rw_spin);
+        wchan_sleep(rw->rw_rwchan);
+
+        spinlock_acquire(&rw->rw_spin);
+        KASSERT(rw->rw_readers > 0);
+        KASSERT(rw->rw_writer == NULL && !rw->rw_handoff);
+        spinlock_release(&rw->rw_spin);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rw_spin);
+        KASSERT(rw->rw_readers > 0);
+        rw->rw_readers--;
+        if (rw->rw_readers == 0 && rw->rw_wwaiting > 0) {
+                /* Last of the batch: hand over to a writer. */
+                rw->rw_wwaiting--;
+                rw->rw_handoff = true;
+                wchan_wakeone(rw->rw_wwchan);
+        }
+        spinlock_release(&rw->rw_spin);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+        KASSERT(rw->rw_writer != curthread);
+
+        spinlock_acquire(&rw->rw_spin);
+        if (rw->rw_writer == NULL && !rw->rw_handoff &&
+            rw->rw_readers == 0) {
+                rw->rw_writer = curthread;
+                spinlock_release(&rw->rw_spin);
+                return;
+        }
+
+        rw->rw_wwaiting++;
+        wchan_lock(rw->rw_wwchan);
+        spinlock_release(&rw->rw_spin);
+        wchan_sleep(rw->rw_wwchan);
+
+        spinlock_acquire(&rw->rw_spin);
+        KASSERT(rw->rw_handoff);
+        KASSERT(rw->rw_writer == NULL && rw->rw_readers == 0);
+        rw->rw_handoff = false;
+        rw->rw_writer = curthread;
+        spinlock_release(&rw->rw_spin);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rw_spin);
+        KASSERT(rw->rw_writer == curthread);
+        rw->rw_writer = NULL;
+        if (rw->rw_rwaiting > 0) {
+                /*
+                 * Let every reader that queued up behind us in at
+                 * once. Readers arriving after this still wait for
+                 * any writer queued behind them.
+                 */
+                rw->rw_readers += rw->rw_rwaiting;
+                rw->rw_rwaiting = 0;
+                wchan_wakeall(rw->rw_rwchan);
+        }
+        else if (rw->rw_wwaiting > 0) {
+                rw->rw_wwaiting--;
+                rw->rw_handoff = true;
+                wchan_wakeone(rw->rw_wwchan);
+        }
+        spinlock_release(&rw->rw_spin);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        return rw->rw_writer == curthread;
+}
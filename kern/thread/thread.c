@@ -50,8 +50,19 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <clock.h>
 
 #include "opt-synchprobs.h"
+#include "opt-mlfq.h"
+#include "opt-tickless.h"
+#include "opt-lockprof.h"
+#include "opt-kstack.h"
+#if OPT_LOCKPROF
+#include <lockprof.h>
+#endif
+#if OPT_KSTACK
+#include <kstack.h>
+#endif
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -72,6 +83,9 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Set once the realtime clock exists and wakeups can be timed. */
+static bool thread_timing = false;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -149,6 +163,17 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Scheduler fields */
+	thread->t_affinity = THREAD_AFFINITY_ALL;
+	thread->t_lastrun = 0;
+	thread->t_moving = false;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_woken = false;
+	thread->t_wakesecs = 0;
+	thread->t_wakensecs = 0;
+	thread->t_sleptat = 0;
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -179,11 +204,24 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	c->c_moving = NULL;
 	c->c_hardclocks = 0;
+	bzero(&c->c_framecache, sizeof(c->c_framecache));
+	spinlock_init(&c->c_framecache.fc_lock);
+	bzero(&c->c_kstacks, sizeof(c->c_kstacks));
+	c->c_asid_last = 0;
+	c->c_asid_cur = 0;
+	c->c_tlb_hand = 0;
+	c->c_tlb_plru = 0;
+	c->c_steals = 0;
+	c->c_migrations = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_wakeups = 0;
+	c->c_wakewait = 0;
+	c->c_wakewait_max = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -214,7 +252,11 @@ cpu_create(unsigned hardware_number)
 		/*c->c_curthread->t_stack = ... */
 	}
 	else {
+#if OPT_KSTACK
+		c->c_curthread->t_stack = kstack_alloc();
+#else
 		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+#endif
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
 		}
@@ -227,6 +269,18 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned num)
+{
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Destroy a thread.
  *
@@ -250,7 +304,11 @@ thread_destroy(struct thread *thread)
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
 	if (thread->t_stack != NULL) {
+#if OPT_KSTACK
+		kstack_free(thread->t_stack);
+#else
 		kfree(thread->t_stack);
+#endif
 	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
@@ -416,6 +474,9 @@ thread_start_cpus(void)
 
 	kprintf("cpu0: %s\n", cpu_identify());
 
+	/* mainbus_bootstrap has attached the realtime clock by now. */
+	thread_timing = true;
+
 	cpu_startup_sem = sem_create("cpu_hatch", 0);
 	mainbus_start_cpus();
 	
@@ -426,6 +487,114 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Number of threads waiting on C's run queue. This reads the count
+ * without the run queue lock, so it may be stale by the time it's
+ * used; it is only for load balancing, where that just makes the
+ * balance a little less exact, and it saves every balancing decision
+ * from taking every CPU's lock.
+ */
+static
+unsigned
+cpu_load(struct cpu *c)
+{
+	return *(volatile unsigned *)&c->c_runqueue.tl_count;
+}
+
+/*
+ * Migration cost model.
+ *
+ * A thread that stopped running on its cpu less than
+ * MIGRATE_HOT_HARDCLOCKS ago is assumed to still have its working set
+ * in that cpu's cache, so moving it would cost more than it gains.
+ * Once it's cold, it may move to the least loaded cpu it is allowed
+ * on, counting the running thread as well as the queued ones, but only
+ * if that is strictly less loaded than where it was.
+ */
+#define MIGRATE_HOT_HARDCLOCKS	2
+
+static
+bool
+thread_allowed(struct thread *t, struct cpu *c)
+{
+	return (t->t_affinity & (1U << c->c_number)) != 0;
+}
+
+static
+bool
+thread_cache_hot(struct thread *t)
+{
+	return t->t_cpu->c_hardclocks - t->t_lastrun < MIGRATE_HOT_HARDCLOCKS;
+}
+
+static
+unsigned
+cpu_busy(struct cpu *c)
+{
+	return cpu_load(c) + (c->c_isidle ? 0 : 1);
+}
+
+/*
+ * Choose the cpu T should run on next. T is not running, and its
+ * t_cpu is where it last ran.
+ */
+static
+struct cpu *
+thread_pickcpu(struct thread *t)
+{
+	struct cpu *c, *best, *last;
+	unsigned i, load, bestload;
+
+	last = t->t_cpu;
+	if (thread_allowed(t, last) && thread_cache_hot(t)) {
+		return last;
+	}
+
+	best = NULL;
+	bestload = 0;
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!thread_allowed(t, c)) {
+			continue;
+		}
+		load = cpu_busy(c);
+		if (best == NULL || load < bestload ||
+		    (load == bestload && c == last)) {
+			best = c;
+			bestload = load;
+		}
+	}
+
+	/* thread_setaffinity doesn't allow masks with no cpus. */
+	KASSERT(best != NULL);
+	return best;
+}
+
+/*
+ * Put a thread on a run queue. Without mlfq this is plain FIFO. With
+ * it the queue is kept sorted by t_priority, FIFO within each level,
+ * so thread_switch's remhead always takes the highest-priority thread
+ * and thread_consider_migration's remtail the lowest.
+ */
+static
+void
+runqueue_add(struct threadlist *rq, struct thread *t)
+{
+#if OPT_MLFQ
+	struct thread *t2;
+
+	THREADLIST_FORALL_REV(t2, *rq) {
+		if (t2->t_priority <= t->t_priority) {
+			threadlist_insertafter(rq, t2, t);
+			return;
+		}
+	}
+	threadlist_addhead(rq, t);
+#else
+	threadlist_addtail(rq, t);
+#endif
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +619,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(&targetcpu->c_runqueue, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -465,20 +634,43 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 }
 
 /*
- * Create a new thread based on an existing one.
- *
- * The new thread has name NAME, and starts executing in function
- * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
- *
- * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * Finish moving a thread that thread_switch took off this cpu for
+ * thread_setaffinity. Called after the switch, from thread_switch or
+ * thread_startup, once we're on another thread's stack and no longer
+ * hold the run queue lock; interrupts are still off. The thread isn't
+ * allowed here, so thread_pickcpu doesn't care that it's cache-hot.
  */
+static
+void
+thread_moveout(void)
+{
+	struct thread *t;
+
+	t = curcpu->c_moving;
+	if (t == NULL) {
+		return;
+	}
+	curcpu->c_moving = NULL;
+
+	KASSERT(t != curthread);
+	KASSERT(!thread_allowed(t, curcpu->c_self));
+	t->t_cpu = thread_pickcpu(t);
+	DEBUG(DB_THREADS, "Moved thread %s: cpu %u -> %u",
+	      t->t_name, curcpu->c_number, t->t_cpu->c_number);
+	curcpu->c_migrations++;
+	thread_make_runnable(t, false);
+}
+
+/*
+ * thread_fork, but the new thread may run on the CPUs in AFFINITY
+ * instead of the caller's.
+ */
+static
 int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+thread_fork_affinity(const char *name,
+		     struct proc *proc,
+		     void (*entrypoint)(void *data1, unsigned long data2),
+		     void *data1, unsigned long data2, uint32_t affinity)
 {
 	struct thread *newthread;
 	int result;
@@ -493,7 +685,11 @@ thread_fork(const char *name,
 	}
 
 	/* Allocate a stack */
+#if OPT_KSTACK
+	newthread->t_stack = kstack_alloc();
+#else
 	newthread->t_stack = kmalloc(STACK_SIZE);
+#endif
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
@@ -506,6 +702,10 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_affinity = affinity;
+	newthread->t_lastrun = curthread->t_cpu->c_hardclocks -
+		MIGRATE_HOT_HARDCLOCKS;
+	newthread->t_cpu = thread_pickcpu(newthread);
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -528,12 +728,120 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
+	/* Lock the chosen cpu's run queue and make the new thread runnable */
 	thread_make_runnable(newthread, false);
 
 	return 0;
 }
 
+/*
+ * Create a new thread based on an existing one.
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ *
+ * The new thread is created in the process P. If P is null, the
+ * process is inherited from the caller, as is the set of CPUs it may
+ * run on. It starts on the caller's CPU if that is as lightly loaded
+ * as any it may use; having no cache state yet, it is never hot.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	return thread_fork_affinity(name, proc, entrypoint, data1, data2,
+				    curthread->t_affinity);
+}
+
+/*
+ * Called from thread_switch by a CPU about to go idle: take a thread
+ * from the tail of the busiest other CPU's run queue. Idle CPUs are
+ * left alone, since they are about to run what they have. Returns
+ * NULL if there was nothing to take.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t, *t2;
+	unsigned i, load, maxload;
+
+	victim = NULL;
+	maxload = 0;
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		load = cpu_load(c);
+		if (load > maxload) {
+			maxload = load;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	/*
+	 * Take the last thread that may run here, isn't cache-hot there,
+	 * and isn't the victim's curthread (still on the victim's stack;
+	 * see the comment in thread_consider_migration).
+	 */
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = NULL;
+	if (!victim->c_isidle) {
+		THREADLIST_FORALL_REV(t2, victim->c_runqueue) {
+			if (t2 != victim->c_curthread &&
+			    thread_allowed(t2, curcpu->c_self) &&
+			    !thread_cache_hot(t2)) {
+				t = t2;
+				break;
+			}
+		}
+	}
+	if (t != NULL) {
+		threadlist_remove(&victim->c_runqueue, t);
+		t->t_cpu = curcpu->c_self;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t != NULL) {
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, curcpu->c_number);
+		curcpu->c_steals++;
+	}
+	return t;
+}
+
+/*
+ * Record how long NEXT, woken from a wait channel, waited for the CPU.
+ * Called from thread_switch with the run queue locked.
+ */
+static
+void
+thread_account_wakeup(struct thread *next)
+{
+	time_t secs, dsecs;
+	uint32_t nsecs, dnsecs;
+	uint64_t wait;
+
+	gettime(&secs, &nsecs);
+	getinterval(next->t_wakesecs, next->t_wakensecs, secs, nsecs,
+		    &dsecs, &dnsecs);
+	wait = (uint64_t)dsecs * 1000000000 + dnsecs;
+	next->t_woken = false;
+
+	curcpu->c_wakeups++;
+	curcpu->c_wakewait += wait;
+	if (wait > curcpu->c_wakewait_max) {
+		curcpu->c_wakewait_max = wait > 0xffffffff ? 0xffffffff : wait;
+	}
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -580,11 +888,20 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		return;
 	}
 
+	/* Remember when it stopped running, for thread_cache_hot. */
+	cur->t_lastrun = curcpu->c_hardclocks;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
+		if (cur->t_moving) {
+			/* Placed elsewhere after the switch; see below. */
+			KASSERT(curcpu->c_moving == NULL);
+			curcpu->c_moving = cur;
+			break;
+		}
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
@@ -627,6 +944,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before idling, try to steal work from another cpu. A stolen
+	 * thread is on no run queue, so nobody else can get at it
+	 * while we relock our own.
+	 *
+	 * A thread leaving for another cpu (c_moving) can only go once
+	 * we're off its stack. If there's nothing else to switch to,
+	 * it stays; thread_setaffinity tries again.
 	 */
 
 	/* The current cpu is now idle. */
@@ -635,12 +960,38 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL && curcpu->c_moving != NULL) {
+				next = curcpu->c_moving;
+				curcpu->c_moving = NULL;
+			}
+			if (next == NULL) {
+#if OPT_TICKLESS
+				/*
+				 * Nothing here needs the hardclock.
+				 * Wakeups and migrations IPI us.
+				 */
+				mainbus_hardclock_stop();
+				cpu_idle();
+				mainbus_hardclock_start();
+#else
+				cpu_idle();
+#endif
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	if (next->t_woken) {
+		thread_account_wakeup(next);
+	}
+
+#if OPT_KSTACK
+	/* Make sure next's stack won't take a TLB miss here. */
+	kstack_activate(next->t_stack);
+#endif
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -708,6 +1059,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send off the thread we switched from, if it's moving. */
+	thread_moveout();
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -741,6 +1095,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send off the thread we switched from, if it's moving. */
+	thread_moveout();
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -822,17 +1179,105 @@ thread_yield(void)
 /*
  * Scheduler.
  *
+ * Without options mlfq, threads run round-robin: hardclock yields on
+ * every tick and the run queue is FIFO.
+ *
+ * With it, the run queue is a multilevel feedback queue. Each thread
+ * has a level, t_priority, from 0 (highest) to MLFQ_LEVELS-1, and the
+ * run queue is kept sorted by level (see runqueue_add). Then:
+ *
+ *    - A thread at level L may run for MLFQ_QUANTUM(L) hardclocks
+ *      before it is demoted a level and sent behind its new peers.
+ *      Lower levels get longer quanta, since they switch less often.
+ *    - Until then it is only preempted by a higher-level thread.
+ *    - A thread woken from a wait channel moves up a level and gets
+ *      a fresh quantum (thread_wakeup), so the shell, the console
+ *      reader and other threads that mostly sleep stay near the top,
+ *      while CPU hogs sink.
+ *    - Every MLFQ_RESET_HARDCLOCKS, schedule() puts everything on the
+ *      CPU back at level 0, so sunk threads aren't starved forever.
+ *
+ * A woken thread still waits for the next hardclock before it can
+ * preempt; there is no preemption on wakeup.
+ */
+#if OPT_MLFQ
+#define MLFQ_LEVELS		4
+#define MLFQ_QUANTUM(level)	(1U << (level))	/* In hardclocks */
+#define MLFQ_RESET_HARDCLOCKS	100	/* Multiple of SCHEDULE_HARDCLOCKS */
+#endif
+
+/*
+ * Called from hardclock() on every tick.
+ */
+void
+thread_preempt(void)
+{
+#if OPT_MLFQ
+	struct thread *cur, *next;
+	bool yield;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+
+	cur = curthread;
+	cur->t_ticks++;
+	if (cur->t_ticks >= MLFQ_QUANTUM(cur->t_priority)) {
+		/* Used up its quantum. */
+		if (cur->t_priority < MLFQ_LEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		yield = true;
+	}
+	else if (threadlist_isempty(&curcpu->c_runqueue)) {
+		yield = false;
+	}
+	else {
+		next = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+		yield = next->t_priority < cur->t_priority;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (!yield) {
+		return;
+	}
+#endif
+	thread_yield();
+}
+
+/*
  * This is called periodically from hardclock(). It should reshuffle
  * the current CPU's run queue by job priority.
  */
-
 void
 schedule(void)
 {
+#if OPT_MLFQ
+	struct thread *t;
+
+	if ((curcpu->c_hardclocks % MLFQ_RESET_HARDCLOCKS) != 0) {
+		return;
+	}
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * Everything goes back to level 0. The queue stays in order, so
+	 * threads that were waiting longest at the higher levels still
+	 * go first. Sleeping threads are reset as they wake up.
 	 */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	THREADLIST_FORALL(t, curcpu->c_runqueue) {
+		t->t_priority = 0;
+		t->t_ticks = 0;
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+#endif
 }
 
 /*
@@ -848,9 +1293,13 @@ schedule(void)
  * and the performance loss due to underutilization of some CPUs is
  * something that needs to be tuned and probably is workload-specific.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * System/161 does not (yet) model such cache effects, but we assume
+ * it does: a thread that ran within the last MIGRATE_HOT_HARDCLOCKS
+ * is left where it is, and the rest go only where thread_pickcpu
+ * says, which respects their affinity.
+ *
+ * This only pushes. A CPU that runs out of work pulls from the others
+ * itself (thread_steal), so it doesn't have to wait for this.
  */
 void
 thread_consider_migration(void)
@@ -858,19 +1307,18 @@ thread_consider_migration(void)
 	unsigned my_count, total_count, one_share, to_send;
 	unsigned i, numcpus;
 	struct cpu *c;
-	struct threadlist victims;
+	struct threadlist victims, leftovers;
+	struct threadlistnode *tln;
 	struct thread *t;
 
 	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += cpu_load(c);
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = cpu_load(c);
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
@@ -881,61 +1329,60 @@ thread_consider_migration(void)
 	to_send = my_count - one_share;
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+	tln = curcpu->c_runqueue.tl_tail.tln_prev;
+	while (tln->tln_prev != NULL && to_send > 0) {
+		t = tln->tln_self;
+		tln = tln->tln_prev;
+		/*
+		 * Ordinarily, curthread will not appear on the run
+		 * queue. However, it can under the following
+		 * circumstances:
+		 *   - it went to sleep;
+		 *   - the processor became idle, so it remained
+		 *     curthread;
+		 *   - it was reawakened, so it was put on the run
+		 *     queue;
+		 *   - and the processor hasn't fully unidled yet, so
+		 *     all these things are still true.
+		 *
+		 * If the timer interrupt happens at (almost) exactly
+		 * the proper moment, we can come here while things are
+		 * in this state and see curthread. However, *migrating*
+		 * curthread can cause bad things to happen (Exercise:
+		 * Why? And what?) so skip it.
+		 *
+		 * Also leave threads whose cache here is still warm.
+		 */
+		if (t == curthread || thread_cache_hot(t)) {
+			continue;
+		}
+		threadlist_remove(&curcpu->c_runqueue, t);
 		threadlist_addhead(&victims, t);
+		to_send--;
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
+	threadlist_init(&leftovers);
+	while ((t = threadlist_remhead(&victims)) != NULL) {
+		c = thread_pickcpu(t);
 		if (c == curcpu->c_self) {
+			/* Nowhere better it's allowed to go. */
+			threadlist_addtail(&leftovers, t);
 			continue;
 		}
+
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
+		t->t_cpu = c;
+		runqueue_add(&c->c_runqueue, t);
+		DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u",
+		      t->t_name, curcpu->c_number, c->c_number);
+		curcpu->c_migrations++;
+		if (c->c_isidle) {
 			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
+			 * Other processor is idle; send interrupt to
+			 * make sure it unidles.
 			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+			ipi_send(c, IPI_UNIDLE);
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
@@ -945,18 +1392,52 @@ thread_consider_migration(void)
 	 * changed while we were working and we may end up with leftovers.
 	 * Don't panic; just put them back on our own run queue.
 	 */
-	if (!threadlist_isempty(&victims)) {
+	if (!threadlist_isempty(&leftovers)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+		while ((t = threadlist_remhead(&leftovers)) != NULL) {
+			runqueue_add(&curcpu->c_runqueue, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
+	threadlist_cleanup(&leftovers);
 
 	KASSERT(threadlist_isempty(&victims));
 	threadlist_cleanup(&victims);
 }
 
+void
+thread_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, wakeups;
+	uint64_t wait;
+	uint32_t max;
+
+	kprintf("cpu   wakeups  avg usec  max usec    steals  migrations\n");
+	for (i = 0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		wakeups = c->c_wakeups;
+		wait = c->c_wakewait;
+		max = c->c_wakewait_max;
+		c->c_wakeups = 0;
+		c->c_wakewait = 0;
+		c->c_wakewait_max = 0;
+		spinlock_release(&c->c_runqueue_lock);
+
+		kprintf("%3u  %8u  %8llu  %8u  %8u  %10u\n", i, wakeups,
+			wakeups ? wait / wakeups / 1000 : 0ULL, max / 1000,
+			c->c_steals, c->c_migrations);
+	}
+#if OPT_LOCKSTAT
+	for (i = 0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("cpu%u ", i);
+		spinlock_printstats(&c->c_runqueue_lock, "runqueue");
+	}
+#endif
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -1025,9 +1506,129 @@ wchan_sleep(struct wchan *wc)
 	/* may not sleep in an interrupt handler */
 	KASSERT(!curthread->t_in_interrupt);
 
+#if OPT_LOCKPROF
+	/* The waker reports the sleep; it knows the channel still exists. */
+	curthread->t_sleptat = lockprof_now();
+#endif
 	thread_switch(S_SLEEP, wc);
 }
 
+#if OPT_LOCKPROF
+/*
+ * Report TARGET's sleep on WC to the profiler. The caller holds the
+ * channel lock, so wc_name is still good.
+ */
+static
+void
+wchan_profwake(struct wchan *wc, struct thread *target)
+{
+	uint64_t now, slept;
+
+	now = lockprof_now();
+	slept = target->t_sleptat != 0 ? now - target->t_sleptat : 0;
+	lockprof_record(LOCKPROF_WCHAN, NULL, wc->wc_name, true, slept, slept);
+}
+#endif
+
+/*
+ * Make a thread just taken off a wait channel runnable. It is on no
+ * list now, so nobody else will touch it until it's on a run queue.
+ */
+static
+void
+thread_wakeup(struct thread *target)
+{
+	struct cpu *c;
+
+#if OPT_MLFQ
+	/* It gave up the CPU of its own accord. */
+	if (target->t_priority > 0) {
+		target->t_priority--;
+	}
+	target->t_ticks = 0;
+#endif
+	if (thread_timing) {
+		gettime(&target->t_wakesecs, &target->t_wakensecs);
+		target->t_woken = true;
+	}
+
+	/*
+	 * If its cpu went idle when it went to sleep, it is still that
+	 * cpu's curthread and its stack is still in use there, so it
+	 * has to go back there. Otherwise it can go wherever is best.
+	 */
+	c = target->t_cpu;
+	spinlock_acquire(&c->c_runqueue_lock);
+	if (c->c_curthread != target) {
+		target->t_cpu = thread_pickcpu(target);
+	}
+	if (target->t_cpu != c) {
+		spinlock_release(&c->c_runqueue_lock);
+		thread_make_runnable(target, false);
+		return;
+	}
+	thread_make_runnable(target, true);
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/* The thread thread_setaffinity switches to; see there. */
+static
+void
+thread_movehelper(void *junk, unsigned long junk2)
+{
+	(void)junk;
+	(void)junk2;
+}
+
+int
+thread_setaffinity(uint32_t mask)
+{
+	unsigned i;
+	bool any;
+	int result, spl;
+
+	any = false;
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		if (mask & (1U << i)) {
+			any = true;
+		}
+	}
+	if (!any) {
+		return EINVAL;
+	}
+
+	curthread->t_affinity = mask;
+
+	/*
+	 * We can't put ourselves on another cpu's run queue while we're
+	 * still on our stack here, and if this cpu has nothing else to
+	 * run it idles on our stack. So give it a do-nothing thread
+	 * that may only run here, and yield with t_moving set: the
+	 * switch to that thread sends us off (thread_moveout). If the
+	 * helper ran already, the yield just comes back; try again.
+	 */
+	while (!thread_allowed(curthread, curcpu->c_self)) {
+		result = thread_fork_affinity("affinity", kproc,
+					      thread_movehelper, NULL, 0,
+					      1U << curcpu->c_number);
+		if (result) {
+			return result;
+		}
+		spl = splhigh();
+		/*
+		 * We may have been moved somewhere allowed since
+		 * looking; then the helper just runs and exits.
+		 */
+		if (!thread_allowed(curthread, curcpu->c_self)) {
+			curthread->t_moving = true;
+			thread_yield();
+			curthread->t_moving = false;
+		}
+		splx(spl);
+	}
+	return 0;
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1039,6 +1640,11 @@ wchan_wakeone(struct wchan *wc)
 	/* Lock the channel and grab a thread from it */
 	spinlock_acquire(&wc->wc_lock);
 	target = threadlist_remhead(&wc->wc_threads);
+#if OPT_LOCKPROF
+	if (target != NULL) {
+		wchan_profwake(wc, target);
+	}
+#endif
 	/*
 	 * Nobody else can wake up this thread now, so we don't need
 	 * to hang onto the lock.
@@ -1050,7 +1656,7 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
-	thread_make_runnable(target, false);
+	thread_wakeup(target);
 }
 
 /*
@@ -1070,6 +1676,9 @@ wchan_wakeall(struct wchan *wc)
 	 */
 	spinlock_acquire(&wc->wc_lock);
 	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+#if OPT_LOCKPROF
+		wchan_profwake(wc, target);
+#endif
 		threadlist_addtail(&list, target);
 	}
 	/*
@@ -1084,7 +1693,7 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		thread_wakeup(target);
 	}
 
 	threadlist_cleanup(&list);
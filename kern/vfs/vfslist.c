@@ -87,6 +87,18 @@ DEFARRAY(knowndev, /*no inline*/);
 
 static struct knowndevarray *knowndevs;
 
+/*
+ * Lock for knowndevs and the knowndev entries in it. Lookups take it
+ * for reading; adding devices, mounting and unmounting for writing.
+ * When both are needed, vfs_biglock comes first.
+ *
+ * Only vfs_getdevname gets by with knowndevs_lock alone. getroot, sync
+ * and (un)mount call into filesystems with it held, and emufs still
+ * takes vfs_biglock for its vnode table, so those paths have to take
+ * vfs_biglock first until emufs stops using it.
+ */
+static struct rwlock *knowndevs_lock;
+
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
@@ -103,6 +115,11 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+
 	vfs_biglock = lock_create("vfs_biglock");
 	if (vfs_biglock==NULL) {
 		panic("vfs: Could not create vfs big lock\n");
@@ -155,6 +172,7 @@ vfs_sync(void)
 	unsigned i, num;
 
 	vfs_biglock_acquire();
+	rwlock_acquire_read(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -164,6 +182,7 @@ vfs_sync(void)
 		}
 	}
 
+	rwlock_release_read(knowndevs_lock);
 	vfs_biglock_release();
 
 	return 0;
@@ -171,16 +190,15 @@ vfs_sync(void)
 
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
- * back an appropriate vnode.
+ * back an appropriate vnode. The caller holds knowndevs_lock.
  */
+static
 int
-vfs_getroot(const char *devname, struct vnode **result)
+findroot(const char *devname, struct vnode **result)
 {
 	struct knowndev *kd;
 	unsigned i, num;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -250,6 +268,20 @@ vfs_getroot(const char *devname, struct vnode **result)
 	return ENODEV;
 }
 
+int
+vfs_getroot(const char *devname, struct vnode **result)
+{
+	int err;
+
+	/* FSOP_GETROOT may need the big lock; it comes first. */
+	KASSERT(vfs_biglock_do_i_hold());
+
+	rwlock_acquire_read(knowndevs_lock);
+	err = findroot(devname, result);
+	rwlock_release_read(knowndevs_lock);
+	return err;
+}
+
 /*
  * Given a filesystem, hand back the name of the device it's mounted on.
  */
@@ -257,12 +289,12 @@ const char *
 vfs_getdevname(struct fs *fs)
 {
 	struct knowndev *kd;
+	const char *name = NULL;
 	unsigned i, num;
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
-
+	rwlock_acquire_read(knowndevs_lock);
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -274,11 +306,13 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
+	rwlock_release_read(knowndevs_lock);
 
-	return NULL;
+	return name;
 }
 
 /*
@@ -338,7 +372,7 @@ badnames(const char *n1, const char *n2, const char *n3)
 	unsigned i, num;
 	struct knowndev *kd;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -379,6 +413,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	int result;
 
 	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	name = kstrdup(dname);
 	if (name==NULL) {
@@ -412,6 +447,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	}
 
 	if (badnames(name, rawname, volname)) {
+		rwlock_release_write(knowndevs_lock);
 		vfs_biglock_release();
 		return EEXIST;
 	}
@@ -423,6 +459,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		dev->d_devnumber = index+1;
 	}
 
+	rwlock_release_write(knowndevs_lock);
 	vfs_biglock_release();
 	return result;
 
@@ -441,6 +478,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		kfree(kd);
 	}
 	
+	rwlock_release_write(knowndevs_lock);
 	vfs_biglock_release();
 	return ENOMEM;
 }
@@ -480,7 +518,7 @@ findmount(const char *devname, struct knowndev **result)
 	unsigned i, num;
 	bool found = false;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
@@ -515,14 +553,17 @@ vfs_mount(const char *devname, void *data,
 	int result;
 
 	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
+		rwlock_release_write(knowndevs_lock);
 		vfs_biglock_release();
 		return result;
 	}
 
 	if (kd->kd_fs != NULL) {
+		rwlock_release_write(knowndevs_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
@@ -531,6 +572,7 @@ vfs_mount(const char *devname, void *data,
 
 	result = mountfunc(data, kd->kd_device, &fs);
 	if (result) {
+		rwlock_release_write(knowndevs_lock);
 		vfs_biglock_release();
 		return result;
 	}
@@ -543,6 +585,7 @@ vfs_mount(const char *devname, void *data,
 	kprintf("vfs: Mounted %s: on %s\n",
 		volname ? volname : kd->kd_name, kd->kd_name);
 
+	rwlock_release_write(knowndevs_lock);
 	vfs_biglock_release();
 	return 0;
 }
@@ -558,6 +601,7 @@ vfs_unmount(const char *devname)
 	int result;
 
 	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -589,6 +633,7 @@ vfs_unmount(const char *devname)
 	KASSERT(result==0);
 
  fail:
+	rwlock_release_write(knowndevs_lock);
 	vfs_biglock_release();
 	return result;
 }
@@ -604,6 +649,7 @@ vfs_unmountall(void)
 	int result;
 
 	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -650,6 +696,7 @@ vfs_unmountall(void)
 		dev->kd_fs = NULL;
 	}
 
+	rwlock_release_write(knowndevs_lock);
 	vfs_biglock_release();
 
 	return 0;
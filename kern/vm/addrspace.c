@@ -0,0 +1,514 @@
+/*
+ * Address spaces for the paging VM system.
+ *
+ * An address space is a list of regions (the valid ranges of user
+ * addresses and what may be done with them) plus a page table that
+ * records which of those pages currently have a frame. Frames are
+ * only allocated when vm_fault sees the first touch of a page, and
+ * that is also when a page of the executable is read in.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <array.h>
+#include <synch.h>
+#include <vnode.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <pagecache.h>
+#include <vm.h>
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as;
+
+	as = kmalloc(sizeof(struct addrspace));
+	if (as == NULL) {
+		return NULL;
+	}
+
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+
+	as->as_regions = array_create();
+	if (as->as_regions == NULL) {
+		pt_destroy(as->as_pt);
+		kfree(as);
+		return NULL;
+	}
+
+	as->as_lock = lock_create("as_lock");
+	if (as->as_lock == NULL) {
+		array_destroy(as->as_regions);
+		pt_destroy(as->as_pt);
+		kfree(as);
+		return NULL;
+	}
+
+	as->loadelf_finish = false;
+	as->as_evicting = 0;
+	vm_asid_retire(as);
+	as->as_vnode = NULL;
+	as->as_heap = NULL;
+	as->as_brk = 0;
+	as->as_ra_window = VM_RAMIN * 2;
+	as->as_ra_num = 0;
+
+	return as;
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+	struct as_region *reg;
+	unsigned i;
+
+	/*
+	 * Another thread may be paging out one of our frames. It takes
+	 * our lock and gives up once it sees as_pt is gone, but we have
+	 * to wait for it to let go of the lock before freeing it.
+	 */
+	vm_refill_forget(as);
+	lock_acquire(as->as_lock);
+	pt_destroy(as->as_pt);
+	as->as_pt = NULL;
+	lock_release(as->as_lock);
+	page_evict_wait(as);
+
+	/* Mapped files go once their pages are unmapped. */
+	for (i = 0; i < array_num(as->as_regions); i++) {
+		reg = array_get(as->as_regions, i);
+		if (reg->ar_mapvnode != NULL) {
+			pagecache_close(reg->ar_mapvnode);
+		}
+		kfree(reg);
+	}
+	array_setsize(as->as_regions, 0);
+	array_destroy(as->as_regions);
+
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
+	}
+	lock_destroy(as->as_lock);
+	kfree(as);
+}
+
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *new;
+	struct as_region *oldreg, *newreg;
+	unsigned i;
+	int result;
+
+	new = as_create();
+	if (new == NULL) {
+		return ENOMEM;
+	}
+
+	for (i = 0; i < array_num(old->as_regions); i++) {
+		oldreg = array_get(old->as_regions, i);
+		result = as_define_region(new, oldreg->ar_vbase,
+					  oldreg->ar_npages * PAGE_SIZE,
+					  oldreg->ar_perm & AR_READ,
+					  oldreg->ar_perm & AR_WRITE,
+					  oldreg->ar_perm & AR_EXEC);
+		if (result) {
+			as_destroy(new);
+			return result;
+		}
+		newreg = array_get(new->as_regions, i);
+		newreg->ar_filevaddr = oldreg->ar_filevaddr;
+		newreg->ar_fileoffset = oldreg->ar_fileoffset;
+		newreg->ar_filesize = oldreg->ar_filesize;
+		if (oldreg->ar_mapvnode != NULL) {
+			result = pagecache_open(oldreg->ar_mapvnode);
+			if (result) {
+				as_destroy(new);
+				return result;
+			}
+			newreg->ar_mapvnode = oldreg->ar_mapvnode;
+			newreg->ar_mapoffset = oldreg->ar_mapoffset;
+		}
+		newreg->ar_perm = oldreg->ar_perm;
+		if (oldreg == old->as_heap) {
+			new->as_heap = newreg;
+		}
+	}
+	new->loadelf_finish = old->loadelf_finish;
+	new->as_brk = old->as_brk;
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
+	}
+
+	/*
+	 * Share frames copy-on-write rather than copying them. pt_copy
+	 * takes write permission away from OLD's pages, so any writable
+	 * entries for them, on any CPU, have to go: give OLD new ASIDs.
+	 * (OLD belongs to the forking process, which is running here.)
+	 */
+	lock_acquire(old->as_lock);
+	result = pt_copy(old->as_pt, new->as_pt);
+	vm_asid_retire(old);
+	as_activate();
+	lock_release(old->as_lock);
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+
+	*ret = new;
+	return 0;
+}
+
+void
+as_activate(void)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/* Kernel threads don't have an address spaces to activate */
+		return;
+	}
+
+	/* No flush; our entries are told apart by ASID. */
+	vm_asid_activate(as);
+}
+
+void
+as_deactivate(void)
+{
+	/* nothing */
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	struct as_region *reg;
+	size_t npages;
+	int result;
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	npages = sz / PAGE_SIZE;
+
+	if (vaddr + sz > USERSPACETOP || vaddr + sz < vaddr) {
+		return EFAULT;
+	}
+
+	reg = kmalloc(sizeof(struct as_region));
+	if (reg == NULL) {
+		return ENOMEM;
+	}
+	reg->ar_vbase = vaddr;
+	reg->ar_npages = npages;
+	reg->ar_perm = (readable ? AR_READ : 0) |
+		(writeable ? AR_WRITE : 0) |
+		(executable ? AR_EXEC : 0);
+	reg->ar_filevaddr = vaddr;
+	reg->ar_fileoffset = 0;
+	reg->ar_filesize = 0;
+	reg->ar_mapvnode = NULL;
+	reg->ar_mapoffset = 0;
+
+	result = array_add(as->as_regions, reg, NULL);
+	if (result) {
+		kfree(reg);
+		return result;
+	}
+	return 0;
+}
+
+struct as_region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_region *reg;
+	unsigned i;
+
+	for (i = 0; i < array_num(as->as_regions); i++) {
+		reg = array_get(as->as_regions, i);
+		if (vaddr >= reg->ar_vbase &&
+		    vaddr < reg->ar_vbase + reg->ar_npages * PAGE_SIZE) {
+			return reg;
+		}
+	}
+	return NULL;
+}
+
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr,
+	       struct vnode *v, off_t offset, size_t filesize)
+{
+	struct as_region *reg;
+
+	if (filesize == 0) {
+		return 0;
+	}
+
+	reg = as_find_region(as, vaddr);
+	if (reg == NULL ||
+	    vaddr + filesize > reg->ar_vbase + reg->ar_npages * PAGE_SIZE ||
+	    vaddr + filesize < vaddr) {
+		return EFAULT;
+	}
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	else if (as->as_vnode != v) {
+		/* All the regions come from one executable. */
+		return EINVAL;
+	}
+
+	reg->ar_filevaddr = vaddr;
+	reg->ar_fileoffset = offset;
+	reg->ar_filesize = filesize;
+	return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/*
+	 * Nothing to allocate, and nothing to read: vm_fault reads each
+	 * page of the executable when it is first touched. Until
+	 * as_complete_load, every region is writable in case the loader
+	 * writes to one.
+	 */
+	as->loadelf_finish = false;
+	return 0;
+}
+
+int
+as_complete_load(struct addrspace *as)
+{
+	struct as_region *reg;
+	vaddr_t top;
+	unsigned i;
+	int result;
+
+	as->loadelf_finish = true;
+
+	/* Start the (empty) heap above the highest segment. */
+	top = 0;
+	for (i = 0; i < array_num(as->as_regions); i++) {
+		reg = array_get(as->as_regions, i);
+		if (reg->ar_vbase + reg->ar_npages * PAGE_SIZE > top) {
+			top = reg->ar_vbase + reg->ar_npages * PAGE_SIZE;
+		}
+	}
+	result = as_define_region(as, top, 0, 1, 1, 0);
+	if (result) {
+		return result;
+	}
+	as->as_heap = array_get(as->as_regions, i);
+	as->as_brk = top;
+
+	/*
+	 * Drop TLB entries the loader created for read-only pages;
+	 * they were loaded writable.
+	 */
+	vm_asid_retire(as);
+	as_activate();
+	return 0;
+}
+
+/*
+ * Return true if no region overlaps [START, END).
+ */
+static
+bool
+as_range_free(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct as_region *reg;
+	unsigned i;
+
+	for (i = 0; i < array_num(as->as_regions); i++) {
+		reg = array_get(as->as_regions, i);
+		if (start < reg->ar_vbase + reg->ar_npages * PAGE_SIZE &&
+		    reg->ar_vbase < end) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int
+as_sbrk(struct addrspace *as, int amount, vaddr_t *oldbrk)
+{
+	struct as_region *heap = as->as_heap;
+	vaddr_t newbrk, oldtop, newtop;
+
+	if (heap == NULL) {
+		return ENOMEM;
+	}
+
+	newbrk = as->as_brk + amount;
+	if (amount < 0) {
+		if (newbrk > as->as_brk || newbrk < heap->ar_vbase) {
+			return EINVAL;
+		}
+	}
+	else if (newbrk < as->as_brk || newbrk > USERSPACETOP) {
+		return ENOMEM;
+	}
+
+	oldtop = heap->ar_vbase + heap->ar_npages * PAGE_SIZE;
+	newtop = (newbrk + PAGE_SIZE - 1) & PAGE_FRAME;
+	if (newtop > oldtop && !as_range_free(as, oldtop, newtop)) {
+		/* Into the stack or a mapping. */
+		return ENOMEM;
+	}
+	heap->ar_npages = (newtop - heap->ar_vbase) / PAGE_SIZE;
+
+	if (newtop < oldtop) {
+		/* Give back the frames, and get rid of our TLB entries. */
+		lock_acquire(as->as_lock);
+		pt_clear(as->as_pt, newtop, oldtop);
+		vm_asid_retire(as);
+		as_activate();
+		lock_release(as->as_lock);
+	}
+
+	*oldbrk = as->as_brk;
+	as->as_brk = newbrk;
+	return 0;
+}
+
+int
+as_mmap(struct addrspace *as, vaddr_t *addr, size_t len, int prot,
+	int flags, struct vnode *v, off_t offset)
+{
+	struct as_region *reg;
+	vaddr_t base, top;
+	size_t sz;
+	unsigned i;
+	int result;
+
+	if (len == 0 || (offset & ~(off_t)PAGE_FRAME) != 0 || offset < 0) {
+		return EINVAL;
+	}
+	if ((flags & (MAP_SHARED | MAP_PRIVATE)) == 0 ||
+	    (flags & (MAP_SHARED | MAP_PRIVATE)) == (MAP_SHARED | MAP_PRIVATE)) {
+		return EINVAL;
+	}
+	sz = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+	if (sz < len) {
+		return ENOMEM;
+	}
+
+	if (flags & MAP_FIXED) {
+		base = *addr;
+		if ((base & ~(vaddr_t)PAGE_FRAME) != 0 ||
+		    base + sz > USERSPACETOP || base + sz < base) {
+			return EINVAL;
+		}
+		if (!as_range_free(as, base, base + sz)) {
+			return ENOMEM;
+		}
+	}
+	else {
+		/* Work down from the bottom of the stack for a hole. */
+		top = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+		while (1) {
+			base = top - sz;
+			if (base > top || base < as->as_brk) {
+				return ENOMEM;
+			}
+			for (i = 0; i < array_num(as->as_regions); i++) {
+				reg = array_get(as->as_regions, i);
+				if (base < reg->ar_vbase + reg->ar_npages * PAGE_SIZE &&
+				    reg->ar_vbase < top) {
+					break;
+				}
+			}
+			if (i == array_num(as->as_regions)) {
+				break;
+			}
+			top = reg->ar_vbase;
+		}
+	}
+
+	result = pagecache_open(v);
+	if (result) {
+		return result;
+	}
+	result = as_define_region(as, base, sz, prot & PROT_READ,
+				  prot & PROT_WRITE, prot & PROT_EXEC);
+	if (result) {
+		pagecache_close(v);
+		return result;
+	}
+	reg = array_get(as->as_regions, array_num(as->as_regions) - 1);
+	reg->ar_mapvnode = v;
+	reg->ar_mapoffset = offset;
+	if (flags & MAP_SHARED) {
+		reg->ar_perm |= AR_SHARED;
+	}
+
+	*addr = base;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct as_region *reg;
+	unsigned i;
+
+	for (i = 0; i < array_num(as->as_regions); i++) {
+		reg = array_get(as->as_regions, i);
+		if (reg->ar_vbase == addr && reg->ar_mapvnode != NULL) {
+			break;
+		}
+	}
+	if (i == array_num(as->as_regions) ||
+	    (len + PAGE_SIZE - 1) / PAGE_SIZE != reg->ar_npages) {
+		/* Only whole mappings can be unmapped. */
+		return EINVAL;
+	}
+
+	lock_acquire(as->as_lock);
+	pt_clear(as->as_pt, reg->ar_vbase,
+		 reg->ar_vbase + reg->ar_npages * PAGE_SIZE);
+	vm_asid_retire(as);
+	as_activate();
+	lock_release(as->as_lock);
+
+	array_remove(as->as_regions, i);
+	pagecache_close(reg->ar_mapvnode);
+	kfree(reg);
+	return 0;
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	int result;
+
+	result = as_define_region(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+				  VM_STACKPAGES * PAGE_SIZE, 1, 1, 0);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = USERSTACK;
+	return 0;
+}
@@ -0,0 +1,819 @@
+/*
+ * Coremap: physical page frame allocator.
+ *
+ * Each frame between mem_begin and mem_end has a small descriptor in
+ * the coremap array. Free frames are kept by a binary buddy allocator:
+ * free blocks of 2^k frames (aligned to 2^k frames from mem_begin)
+ * sit on freelist[k], linked through the descriptor of their first
+ * frame. Allocating one frame pops freelist[0] when it is not empty,
+ * and otherwise splits the smallest larger block; freeing merges a
+ * block with its buddy for as long as the buddy is free. Neither ever
+ * scans the coremap.
+ *
+ * Kernel allocations (alloc_kpages) may ask for any number of
+ * contiguous frames. They get the smallest block that fits and the
+ * unused tail is handed straight back, so a 3-page kmalloc costs 3
+ * frames, not 4. The head descriptor remembers the run length so that
+ * free_kpages does not need to be told it.
+ *
+ * Single frames (all user pages, and most of the kernel heap) mostly
+ * don't touch the free lists at all: each cpu keeps a small magazine
+ * of free frames in struct cpu. An allocation on an empty magazine
+ * refills it with FRAMECACHE_BATCH frames in one trip to the coremap
+ * lock, and a free into a full one drains the same number back. Frames
+ * sitting in a magazine are not counted by coremap_freecount. When the
+ * free lists run dry, all the magazines are emptied back into them
+ * before anybody is told memory is exhausted.
+ *
+ * User frames can be shared copy-on-write between address spaces
+ * after fork, so each user frame also has a reference count.
+ * page_alloc sets it to 1, page_share bumps it, and page_free only
+ * returns the frame to the free lists when the last reference goes.
+ *
+ * A user frame mapped by exactly one address space also records that
+ * address space and the virtual address, so that the page can be
+ * found from the frame and paged out. Shared frames have no owner and
+ * are never paged out; the last mapper reclaims ownership the next
+ * time it faults on the page (page_claim). Victims are chosen with
+ * the clock algorithm: every TLB load of a frame clears its idle byte,
+ * and the clock hand sets it as it sweeps past, taking the first owned
+ * frame it finds already idle. The idle bytes are kept apart from the
+ * descriptors so that the assembly TLB refill handler can clear one
+ * knowing only the frame number.
+ *
+ * Before coremap_bootstrap runs, memory comes from ram_stealmem and
+ * can never be given back.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+
+/* Blocks go up to 2^(CM_MAXORDER-1) frames (8M). */
+#define CM_MAXORDER	12
+#define CM_NONE		0xffffffff
+
+/* cme_flags */
+#define CME_FREE	0x01	/* heads a free block of 2^cme_order frames */
+#define CME_KERNEL	0x02	/* heads a kernel run of cme_npages frames */
+#define CME_USER	0x04	/* a user page; see cme_refcount */
+#define CME_CACHED	0x08	/* free, in some cpu's framecache */
+#define CME_BUSY	0x10	/* with CME_USER: being paged out */
+#define CME_PINNED	0x20	/* with CME_USER: permanent; see page_pin */
+
+struct coremap_entry {
+	union {
+		struct {
+			uint32_t next;	/* frame numbers, or CM_NONE */
+			uint32_t prev;
+		} link;			/* if CME_FREE */
+		uint32_t npages;	/* if CME_KERNEL */
+		vaddr_t vaddr;		/* if CME_USER and cme_as is set */
+	} cme_u;
+	struct addrspace *cme_as;	/* if CME_USER: sole mapper, or NULL */
+	uint16_t cme_refcount;		/* if CME_USER */
+	uint8_t cme_order;		/* if CME_FREE */
+	uint8_t cme_flags;
+};
+
+#define cme_next	cme_u.link.next
+#define cme_prev	cme_u.link.prev
+#define cme_npages	cme_u.npages
+#define cme_vaddr	cme_u.vaddr
+
+/*
+ * Wrap rma_stealmem in a spinlock.
+ */
+static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+static struct coremap_entry *coremap = NULL;
+static uint32_t freelist[CM_MAXORDER];
+static unsigned long page_num = 0;
+static unsigned long free_num = 0;
+static paddr_t mem_begin = 0;
+static paddr_t mem_end = 0;
+static uint32_t clock_hand = 0;
+
+/*
+ * One byte per frame, indexed by physical frame number (paddr >> 12):
+ * 0 if the frame has been loaded into a TLB since the clock hand last
+ * passed, otherwise 1. The pointer is biased by mem_begin's frame
+ * number so that the refill handler needn't subtract it.
+ */
+uint8_t *coremap_idle = NULL;
+#define CM_IDLE(pa)	coremap_idle[(pa) / PAGE_SIZE]
+
+#define CM_INDEX(pa)	(((pa) - mem_begin) / PAGE_SIZE)
+#define CM_PADDR(i)	(mem_begin + (paddr_t)(i) * PAGE_SIZE)
+
+////////////////////////////////////////////////////////////
+//
+// Free lists. All of these need coremap_lock.
+
+static
+void
+fl_push(uint32_t idx, unsigned order)
+{
+	struct coremap_entry *e = &coremap[idx];
+
+	e->cme_flags = CME_FREE;
+	e->cme_order = order;
+	e->cme_prev = CM_NONE;
+	e->cme_next = freelist[order];
+	if (freelist[order] != CM_NONE) {
+		coremap[freelist[order]].cme_prev = idx;
+	}
+	freelist[order] = idx;
+}
+
+static
+void
+fl_remove(uint32_t idx)
+{
+	struct coremap_entry *e = &coremap[idx];
+
+	KASSERT(e->cme_flags == CME_FREE);
+	if (e->cme_prev != CM_NONE) {
+		coremap[e->cme_prev].cme_next = e->cme_next;
+	}
+	else {
+		freelist[e->cme_order] = e->cme_next;
+	}
+	if (e->cme_next != CM_NONE) {
+		coremap[e->cme_next].cme_prev = e->cme_prev;
+	}
+	e->cme_flags = 0;
+}
+
+/*
+ * Return a free block of 2^ORDER frames, splitting a bigger one if
+ * need be, or CM_NONE.
+ */
+static
+uint32_t
+buddy_alloc(unsigned order)
+{
+	unsigned o;
+	uint32_t idx;
+
+	for (o = order; o < CM_MAXORDER; o++) {
+		if (freelist[o] != CM_NONE) {
+			break;
+		}
+	}
+	if (o == CM_MAXORDER) {
+		return CM_NONE;
+	}
+
+	idx = freelist[o];
+	fl_remove(idx);
+	while (o > order) {
+		o--;
+		fl_push(idx + (1 << o), o);
+	}
+	free_num -= 1 << order;
+	return idx;
+}
+
+/*
+ * Free the block of 2^ORDER frames at IDX, merging it with its buddy
+ * as far as possible.
+ */
+static
+void
+buddy_free(uint32_t idx, unsigned order)
+{
+	uint32_t buddy;
+
+	free_num += 1 << order;
+	while (order < CM_MAXORDER - 1) {
+		buddy = idx ^ (1 << order);
+		if (buddy + (1 << order) > page_num ||
+		    coremap[buddy].cme_flags != CME_FREE ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		fl_remove(buddy);
+		idx &= ~(uint32_t)(1 << order);
+		order++;
+	}
+	fl_push(idx, order);
+}
+
+/*
+ * Free an arbitrary run of frames by splitting it into the largest
+ * aligned blocks it contains.
+ */
+static
+void
+buddy_free_range(uint32_t idx, unsigned long npages)
+{
+	unsigned order;
+
+	while (npages > 0) {
+		order = 0;
+		while (order < CM_MAXORDER - 1 &&
+		       (idx & (1 << order)) == 0 &&
+		       (2UL << order) <= npages) {
+			order++;
+		}
+		buddy_free(idx, order);
+		idx += 1 << order;
+		npages -= 1 << order;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu frame caches. Each has its own spinlock, which (apart from
+// cm_drain_caches) only its cpu ever takes; fc_lock comes before
+// coremap_lock.
+
+/*
+ * Take one free frame from this cpu's cache, refilling it from the
+ * free lists if it is empty. Returns the frame index, or CM_NONE if
+ * both are empty.
+ */
+static
+uint32_t
+cm_alloc_cached(void)
+{
+	struct framecache *fc;
+	uint32_t idx;
+
+	fc = &curcpu->c_framecache;
+	spinlock_acquire(&fc->fc_lock);
+	fc->fc_allocs++;
+
+	if (fc->fc_count > 0) {
+		fc->fc_allochits++;
+	}
+	else {
+		spinlock_acquire(&coremap_lock);
+		while (fc->fc_count < FRAMECACHE_BATCH) {
+			idx = buddy_alloc(0);
+			if (idx == CM_NONE) {
+				break;
+			}
+			coremap[idx].cme_flags = CME_CACHED;
+			fc->fc_frames[fc->fc_count++] = CM_PADDR(idx);
+		}
+		spinlock_release(&coremap_lock);
+
+		if (free_num < PAGEOUT_LOW) {
+			swap_wakeup();
+		}
+		if (fc->fc_count == 0) {
+			spinlock_release(&fc->fc_lock);
+			return CM_NONE;
+		}
+	}
+
+	idx = CM_INDEX(fc->fc_frames[--fc->fc_count]);
+	KASSERT(coremap[idx].cme_flags == CME_CACHED);
+	spinlock_release(&fc->fc_lock);
+	return idx;
+}
+
+/*
+ * Empty every cpu's cache back into the free lists. Returns how many
+ * frames that gave back.
+ */
+static
+unsigned
+cm_drain_caches(void)
+{
+	struct framecache *fc;
+	unsigned i, n;
+	uint32_t idx;
+
+	n = 0;
+	for (i = 0; i < cpu_count(); i++) {
+		fc = &cpu_get(i)->c_framecache;
+		spinlock_acquire(&fc->fc_lock);
+		spinlock_acquire(&coremap_lock);
+		while (fc->fc_count > 0) {
+			idx = CM_INDEX(fc->fc_frames[--fc->fc_count]);
+			coremap[idx].cme_flags = 0;
+			buddy_free(idx, 0);
+			n++;
+		}
+		spinlock_release(&coremap_lock);
+		spinlock_release(&fc->fc_lock);
+	}
+	return n;
+}
+
+/*
+ * Take one free frame, from this cpu's cache if possible. Returns the
+ * frame index, or CM_NONE if memory is exhausted. The caller fills in
+ * the descriptor.
+ */
+static
+uint32_t
+cm_alloc_one(void)
+{
+	uint32_t idx;
+
+	idx = cm_alloc_cached();
+	if (idx == CM_NONE && cm_drain_caches() > 0) {
+		/* Other cpus were sitting on the last free frames. */
+		idx = cm_alloc_cached();
+	}
+	return idx;
+}
+
+/*
+ * Give back one frame, into this cpu's cache if there is room.
+ */
+static
+void
+cm_free_one(uint32_t idx)
+{
+	struct framecache *fc;
+	uint32_t i;
+
+	coremap[idx].cme_flags = CME_CACHED;
+
+	fc = &curcpu->c_framecache;
+	spinlock_acquire(&fc->fc_lock);
+	fc->fc_frees++;
+
+	if (fc->fc_count < FRAMECACHE_SIZE) {
+		fc->fc_freehits++;
+	}
+	else {
+		spinlock_acquire(&coremap_lock);
+		while (fc->fc_count > FRAMECACHE_SIZE - FRAMECACHE_BATCH) {
+			i = CM_INDEX(fc->fc_frames[--fc->fc_count]);
+			coremap[i].cme_flags = 0;
+			buddy_free(i, 0);
+		}
+		spinlock_release(&coremap_lock);
+	}
+
+	fc->fc_frames[fc->fc_count++] = CM_PADDR(idx);
+	spinlock_release(&fc->fc_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface.
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	unsigned i;
+
+	ram_getsize(&lo, &hi);
+
+	// count the number of pages
+	// coremap: one descriptor and one idle byte each
+	// physical mem: PAGE_SIZE each
+	page_num = (hi - lo) / (PAGE_SIZE + sizeof(struct coremap_entry) + 1);
+	mem_begin = ROUNDUP(lo + page_num * (sizeof(struct coremap_entry) + 1),
+			    PAGE_SIZE);
+
+	// update page num after padding
+	page_num = (hi - mem_begin) / PAGE_SIZE;
+	mem_end = mem_begin + page_num * PAGE_SIZE;
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+	bzero(coremap, page_num * sizeof(struct coremap_entry));
+	coremap_idle = (uint8_t *)&coremap[page_num] - mem_begin / PAGE_SIZE;
+	bzero(&CM_IDLE(mem_begin), page_num);
+	for (i = 0; i < CM_MAXORDER; i++) {
+		freelist[i] = CM_NONE;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	buddy_free_range(0, page_num);
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %lu frames (%luk) available\n",
+		page_num, page_num * PAGE_SIZE / 1024);
+}
+
+paddr_t
+coremap_getppages(unsigned long npages)
+{
+	paddr_t addr;
+	unsigned order;
+	uint32_t idx;
+
+	if (coremap == NULL) {
+		spinlock_acquire(&stealmem_lock);
+		addr = ram_stealmem(npages);
+		spinlock_release(&stealmem_lock);
+		return addr;
+	}
+
+	KASSERT(npages > 0);
+	if (npages == 1) {
+		idx = cm_alloc_one();
+		if (idx == CM_NONE) {
+			return 0;
+		}
+		coremap[idx].cme_flags = CME_KERNEL;
+		coremap[idx].cme_npages = 1;
+		return CM_PADDR(idx);
+	}
+
+	order = 0;
+	while ((1UL << order) < npages) {
+		order++;
+	}
+	if (order >= CM_MAXORDER) {
+		return 0;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	idx = buddy_alloc(order);
+	if (idx == CM_NONE) {
+		/* Cached frames may fill the gaps; try again without. */
+		spinlock_release(&coremap_lock);
+		if (cm_drain_caches() == 0) {
+			return 0;
+		}
+		spinlock_acquire(&coremap_lock);
+		idx = buddy_alloc(order);
+		if (idx == CM_NONE) {
+			spinlock_release(&coremap_lock);
+			return 0;
+		}
+	}
+	if ((1UL << order) > npages) {
+		buddy_free_range(idx + npages, (1UL << order) - npages);
+	}
+	coremap[idx].cme_flags = CME_KERNEL;
+	coremap[idx].cme_npages = npages;
+	spinlock_release(&coremap_lock);
+
+	return CM_PADDR(idx);
+}
+
+void
+coremap_freeppages(paddr_t paddr)
+{
+	uint32_t idx;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	if (paddr < mem_begin) {
+		/* Stolen before the coremap existed; leak it. */
+		return;
+	}
+	KASSERT(paddr < mem_end);
+
+	/* The run is ours, so its descriptor can be read unlocked. */
+	idx = CM_INDEX(paddr);
+	KASSERT(coremap[idx].cme_flags == CME_KERNEL);
+	if (coremap[idx].cme_npages == 1) {
+		cm_free_one(idx);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	coremap[idx].cme_flags = 0;
+	buddy_free_range(idx, coremap[idx].cme_npages);
+	spinlock_release(&coremap_lock);
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+
+	pa = coremap_getppages(npages);
+	if (pa == 0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	coremap_freeppages(KVADDR_TO_PADDR(addr));
+}
+
+/*
+ * Hand out frame IDX, fresh from cm_alloc_one, as a zeroed user page.
+ */
+static
+paddr_t
+cm_user_page(uint32_t idx, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *e;
+	paddr_t pa;
+
+	e = &coremap[idx];
+	e->cme_flags = CME_USER;
+	e->cme_refcount = 1;
+	e->cme_as = as;
+	e->cme_vaddr = vaddr;
+	CM_IDLE(CM_PADDR(idx)) = 0;
+
+	pa = CM_PADDR(idx);
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+	return pa;
+}
+
+paddr_t
+page_alloc(struct addrspace *as, vaddr_t vaddr)
+{
+	uint32_t idx;
+
+	KASSERT(coremap != NULL);
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	while ((idx = cm_alloc_one()) == CM_NONE) {
+		/* Page something out ourselves rather than wait. */
+		if (swap_pageout()) {
+			return 0;
+		}
+	}
+	return cm_user_page(idx, as, vaddr);
+}
+
+paddr_t
+page_tryalloc(struct addrspace *as, vaddr_t vaddr)
+{
+	uint32_t idx;
+
+	KASSERT(coremap != NULL);
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	if (coremap_freecount() < PAGEOUT_LOW) {
+		return 0;
+	}
+	idx = cm_alloc_one();
+	if (idx == CM_NONE) {
+		return 0;
+	}
+	return cm_user_page(idx, as, vaddr);
+}
+
+void
+page_share(paddr_t paddr)
+{
+	struct coremap_entry *e;
+
+	KASSERT(paddr >= mem_begin && paddr < mem_end);
+
+	spinlock_acquire(&coremap_lock);
+	e = &coremap[CM_INDEX(paddr)];
+	KASSERT(e->cme_flags & CME_USER);
+	if (e->cme_flags & CME_PINNED) {
+		spinlock_release(&coremap_lock);
+		return;
+	}
+	KASSERT(e->cme_refcount > 0 && e->cme_refcount < 0xffff);
+	e->cme_refcount++;
+	e->cme_as = NULL;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+page_refcount(paddr_t paddr)
+{
+	struct coremap_entry *e;
+	unsigned count;
+
+	KASSERT(paddr >= mem_begin && paddr < mem_end);
+
+	spinlock_acquire(&coremap_lock);
+	e = &coremap[CM_INDEX(paddr)];
+	/* A pinned frame counts as shared with everybody. */
+	count = (e->cme_flags & CME_PINNED) ? 0xffff : e->cme_refcount;
+	spinlock_release(&coremap_lock);
+	return count;
+}
+
+void
+page_pin(paddr_t paddr)
+{
+	struct coremap_entry *e;
+
+	KASSERT(paddr >= mem_begin && paddr < mem_end);
+
+	spinlock_acquire(&coremap_lock);
+	e = &coremap[CM_INDEX(paddr)];
+	KASSERT(e->cme_flags == CME_USER);
+	e->cme_flags |= CME_PINNED;
+	e->cme_as = NULL;
+	spinlock_release(&coremap_lock);
+}
+
+void
+page_free(paddr_t paddr)
+{
+	struct coremap_entry *e;
+	uint32_t idx;
+	bool last;
+
+	KASSERT(paddr >= mem_begin && paddr < mem_end);
+
+	spinlock_acquire(&coremap_lock);
+	idx = CM_INDEX(paddr);
+	e = &coremap[idx];
+	KASSERT(e->cme_flags & CME_USER);
+	if (e->cme_flags & CME_PINNED) {
+		spinlock_release(&coremap_lock);
+		return;
+	}
+	KASSERT(e->cme_refcount > 0);
+	e->cme_refcount--;
+	/* A frame being paged out is freed by page_evict_done. */
+	last = (e->cme_refcount == 0 && !(e->cme_flags & CME_BUSY));
+	if (last) {
+		e->cme_as = NULL;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (last) {
+		cm_free_one(idx);
+	}
+}
+
+void
+page_touch(paddr_t paddr)
+{
+	KASSERT(paddr >= mem_begin && paddr < mem_end);
+
+	/* Racy, but a lost update only costs the page a clock lap. */
+	CM_IDLE(paddr) = 0;
+}
+
+void
+page_untouch(paddr_t paddr)
+{
+	KASSERT(paddr >= mem_begin && paddr < mem_end);
+
+	CM_IDLE(paddr) = 1;
+}
+
+bool
+page_touched(paddr_t paddr)
+{
+	KASSERT(paddr >= mem_begin && paddr < mem_end);
+
+	return CM_IDLE(paddr) == 0;
+}
+
+void
+page_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *e;
+
+	KASSERT(paddr >= mem_begin && paddr < mem_end);
+
+	e = &coremap[CM_INDEX(paddr)];
+	if (e->cme_as != NULL || e->cme_refcount != 1) {
+		/* Usual case; skip the lock. */
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	if (e->cme_as == NULL && e->cme_refcount == 1 &&
+	    e->cme_flags == CME_USER) {
+		e->cme_as = as;
+		e->cme_vaddr = vaddr;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+paddr_t
+page_evict_select(struct addrspace **as, vaddr_t *vaddr)
+{
+	struct coremap_entry *e;
+	unsigned long n;
+	uint32_t idx;
+
+	spinlock_acquire(&coremap_lock);
+	/* Two laps: the first may only be setting idle bytes. */
+	for (n = 0; n < 2 * page_num; n++) {
+		idx = clock_hand;
+		clock_hand = (clock_hand + 1) % page_num;
+		e = &coremap[idx];
+
+		if (e->cme_flags != CME_USER || e->cme_refcount != 1 ||
+		    e->cme_as == NULL) {
+			continue;
+		}
+		if (!CM_IDLE(CM_PADDR(idx))) {
+			CM_IDLE(CM_PADDR(idx)) = 1;
+			continue;
+		}
+
+		e->cme_flags |= CME_BUSY;
+		e->cme_as->as_evicting++;
+		*as = e->cme_as;
+		*vaddr = e->cme_vaddr;
+		spinlock_release(&coremap_lock);
+		return CM_PADDR(idx);
+	}
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+bool
+page_evict_check(paddr_t paddr, struct addrspace *as)
+{
+	struct coremap_entry *e;
+	bool ok;
+
+	KASSERT(paddr >= mem_begin && paddr < mem_end);
+
+	spinlock_acquire(&coremap_lock);
+	e = &coremap[CM_INDEX(paddr)];
+	KASSERT(e->cme_flags == (CME_USER | CME_BUSY));
+	ok = (e->cme_refcount == 1 && e->cme_as == as);
+	spinlock_release(&coremap_lock);
+	return ok;
+}
+
+void
+page_evict_done(paddr_t paddr, struct addrspace *as, bool evicted)
+{
+	struct coremap_entry *e;
+	uint32_t idx;
+	bool last;
+
+	KASSERT(paddr >= mem_begin && paddr < mem_end);
+
+	spinlock_acquire(&coremap_lock);
+	idx = CM_INDEX(paddr);
+	e = &coremap[idx];
+	KASSERT(e->cme_flags == (CME_USER | CME_BUSY));
+	KASSERT(as->as_evicting > 0);
+	as->as_evicting--;
+	e->cme_flags &= ~CME_BUSY;
+	if (evicted) {
+		e->cme_refcount = 0;
+	}
+	last = (e->cme_refcount == 0);
+	if (last) {
+		e->cme_as = NULL;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (last) {
+		cm_free_one(idx);
+	}
+}
+
+void
+page_evict_wait(struct addrspace *as)
+{
+	unsigned n;
+
+	while (1) {
+		spinlock_acquire(&coremap_lock);
+		n = as->as_evicting;
+		spinlock_release(&coremap_lock);
+		if (n == 0) {
+			break;
+		}
+		thread_yield();
+	}
+}
+
+unsigned long
+coremap_freecount(void)
+{
+	return free_num;
+}
+
+void
+coremap_printstats(void)
+{
+	struct framecache *fc;
+	unsigned i;
+
+	kprintf("coremap: %lu of %lu frames free (not counting caches)\n",
+		free_num, page_num);
+	kprintf("cpu  cached    allocs  hit%%     frees  hit%%\n");
+	for (i = 0; i < cpu_count(); i++) {
+		fc = &cpu_get(i)->c_framecache;
+		kprintf("%3u  %6u  %8u  %3u%%  %8u  %3u%%\n", i,
+			fc->fc_count,
+			fc->fc_allocs,
+			fc->fc_allocs ? fc->fc_allochits * 100 / fc->fc_allocs : 0,
+			fc->fc_frees,
+			fc->fc_frees ? fc->fc_freehits * 100 / fc->fc_frees : 0);
+	}
+#if OPT_LOCKSTAT
+	spinlock_printstats(&coremap_lock, "coremap_lock");
+#endif
+}
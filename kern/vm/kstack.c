@@ -0,0 +1,238 @@
+/*
+ * Pooled, guarded kernel stacks. See kstack.h.
+ *
+ * Slot N of the pool covers KSTACK_STRIDE bytes from KSTACK_BASE +
+ * N * KSTACK_STRIDE: first the guard, which is never mapped, then the
+ * stack. kstack_pa[N] is the memory behind the stack, or 0 if the slot
+ * has never been handed out. It comes from alloc_kpages, so it is
+ * physically contiguous, and it stays with the slot for good, so a
+ * translation for a stack page never goes stale and TLB entries for
+ * stacks never need shooting down.
+ *
+ * Free slots are on some cpu's kstackcache (interrupts off) or on
+ * kstack_freelist (kstack_lock). Slots from kstack_next up have not
+ * been used yet.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <mips/trapframe.h>
+#include <vm.h>
+#include <kstack.h>
+
+#define KSTACK_STRIDE	(2 * STACK_SIZE)
+#define KSTACK_END	(KSTACK_BASE + KSTACK_MAX * KSTACK_STRIDE)
+#define KSTACK_SLOT(va)	(((va) - KSTACK_BASE) / KSTACK_STRIDE)
+#define KSTACK_ADDR(n)	(KSTACK_BASE + (n) * KSTACK_STRIDE + STACK_SIZE)
+#define KSTACK_INPOOL(va) ((va) >= KSTACK_BASE && (va) < KSTACK_END)
+
+/* Stack translations are global, so the ASID doesn't matter. */
+#define KSTACK_TLBLO	(TLBLO_VALID | TLBLO_DIRTY | TLBLO_GLOBAL)
+
+static struct spinlock kstack_lock = SPINLOCK_INITIALIZER;
+static unsigned kstack_freelist[KSTACK_MAX];
+static unsigned kstack_nfree;
+static unsigned kstack_next;
+static paddr_t kstack_pa[KSTACK_MAX];
+static bool kstack_ready = false;
+
+void
+kstack_bootstrap(void)
+{
+	kstack_ready = true;
+}
+
+/*
+ * Take a free slot, this cpu's cache first. Returns KSTACK_MAX if the
+ * pool is used up.
+ */
+static
+unsigned
+kstack_getslot(void)
+{
+	struct kstackcache *kc;
+	unsigned slot;
+	int spl;
+
+	spl = splhigh();
+	kc = &curcpu->c_kstacks;
+	if (kc->kc_count > 0) {
+		slot = kc->kc_slots[--kc->kc_count];
+		splx(spl);
+		return slot;
+	}
+	splx(spl);
+
+	spinlock_acquire(&kstack_lock);
+	if (kstack_nfree > 0) {
+		slot = kstack_freelist[--kstack_nfree];
+	}
+	else if (kstack_next < KSTACK_MAX) {
+		slot = kstack_next++;
+	}
+	else {
+		slot = KSTACK_MAX;
+	}
+	spinlock_release(&kstack_lock);
+	return slot;
+}
+
+/*
+ * Put a slot back, into this cpu's cache if there is room.
+ */
+static
+void
+kstack_putslot(unsigned slot)
+{
+	struct kstackcache *kc;
+	int spl;
+
+	spl = splhigh();
+	kc = &curcpu->c_kstacks;
+	if (kc->kc_count < KSTACKCACHE_SIZE) {
+		kc->kc_slots[kc->kc_count++] = slot;
+		splx(spl);
+		return;
+	}
+	splx(spl);
+
+	spinlock_acquire(&kstack_lock);
+	KASSERT(kstack_nfree < KSTACK_MAX);
+	kstack_freelist[kstack_nfree++] = slot;
+	spinlock_release(&kstack_lock);
+}
+
+void *
+kstack_alloc(void)
+{
+	unsigned slot;
+	vaddr_t va;
+
+	if (!kstack_ready) {
+		return kmalloc(STACK_SIZE);
+	}
+
+	slot = kstack_getslot();
+	if (slot == KSTACK_MAX) {
+		/* Out of slots; make do without a guard. */
+		return kmalloc(STACK_SIZE);
+	}
+
+	if (kstack_pa[slot] == 0) {
+		va = alloc_kpages(KSTACK_PAGES);
+		if (va == 0) {
+			kstack_putslot(slot);
+			return NULL;
+		}
+		kstack_pa[slot] = KVADDR_TO_PADDR(va);
+	}
+	return (void *)KSTACK_ADDR(slot);
+}
+
+void
+kstack_free(void *stack)
+{
+	vaddr_t va = (vaddr_t)stack;
+
+	if (!KSTACK_INPOOL(va)) {
+		kfree(stack);
+		return;
+	}
+	KASSERT(va == KSTACK_ADDR(KSTACK_SLOT(va)));
+	KASSERT(kstack_pa[KSTACK_SLOT(va)] != 0);
+	kstack_putslot(KSTACK_SLOT(va));
+}
+
+void
+kstack_activate(void *stack)
+{
+	struct kstackcache *kc;
+	vaddr_t va = (vaddr_t)stack;
+	paddr_t pa;
+	unsigned cpu, set, i;
+	uint32_t ehi;
+	int idx;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	cpu = curcpu->c_number;
+	if (!KSTACK_INPOOL(va)) {
+		cpustackguards[cpu][0] = 0;
+		cpustackguards[cpu][1] = 0;
+		return;
+	}
+
+	kc = &curcpu->c_kstacks;
+	pa = kstack_pa[KSTACK_SLOT(va)];
+	KASSERT(pa != 0);
+
+	idx = tlb_probe(va, 0);
+	if (idx >= 0 && idx < KSTACK_TLBSLOTS) {
+		/* Wired already (switching back to a thread just left). */
+		set = idx / KSTACK_PAGES;
+	}
+	else {
+		/* Use the set the stack we're on isn't in. */
+		set = kc->kc_set ^ 1;
+		for (i = 0; i < KSTACK_PAGES; i++) {
+			ehi = va + i * PAGE_SIZE;
+			/* Never two entries for a page: drop kstack_fault's. */
+			idx = tlb_probe(ehi, 0);
+			if (idx >= 0) {
+				KASSERT(idx >= KSTACK_TLBSLOTS);
+				tlb_write(TLBHI_INVALID(idx), TLBLO_INVALID(),
+					  idx);
+			}
+			tlb_write(ehi, (pa + i * PAGE_SIZE) | KSTACK_TLBLO,
+				  set * KSTACK_PAGES + i);
+		}
+	}
+	vm_asid_restore();
+
+	kc->kc_set = set;
+	cpustackguards[cpu][0] = va - STACK_SIZE;
+	cpustackguards[cpu][1] = va + KSTACK_SLOP;
+}
+
+bool
+kstack_fault(vaddr_t vaddr)
+{
+	unsigned slot;
+	vaddr_t va;
+	uint32_t ehi;
+	int spl;
+
+	if (!KSTACK_INPOOL(vaddr)) {
+		return false;
+	}
+	slot = KSTACK_SLOT(vaddr);
+	va = KSTACK_ADDR(slot);
+	if (vaddr < va || kstack_pa[slot] == 0) {
+		/* A guard, or a slot nobody has had. */
+		return false;
+	}
+
+	ehi = vaddr & TLBHI_VPAGE;
+	spl = splhigh();
+	/* We may have moved cpus, or this one may have wired it since. */
+	if (tlb_probe(ehi, 0) < 0) {
+		tlb_random(ehi, (kstack_pa[slot] + (ehi - va)) | KSTACK_TLBLO);
+	}
+	vm_asid_restore();
+	splx(spl);
+	return true;
+}
+
+bool
+kstack_isguard(vaddr_t vaddr)
+{
+	if (!KSTACK_INPOOL(vaddr)) {
+		return false;
+	}
+	return vaddr < KSTACK_ADDR(KSTACK_SLOT(vaddr));
+}
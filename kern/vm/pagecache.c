@@ -0,0 +1,339 @@
+/*
+ * Page cache for memory-mapped files. See pagecache.h.
+ *
+ * Each mapped file has a struct pc_file holding an array of its
+ * cached pages, indexed by page number. An entry is the frame's
+ * physical address with PC_DIRTY and PC_BUSY in the low bits, or 0
+ * if the page isn't cached. The cache holds one reference to each
+ * frame; every PTE mapping it holds another.
+ *
+ * pc_lock is never held across I/O. A page being read in is marked
+ * PC_BUSY, and anyone else who wants it waits on pc_cv. Dirty pages
+ * are written back with an extra frame reference instead of the lock.
+ * This matters because VOP_FSYNC can be called with file system locks
+ * held (vfs_sync holds vfs_biglock), while reading a page in needs the
+ * file's own lock.
+ *
+ * A shared mapping's pages only fault on the first write, so once a
+ * page is dirty it stays dirty until the file is unmapped everywhere.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <array.h>
+#include <synch.h>
+#include <uio.h>
+#include <stat.h>
+#include <vnode.h>
+#include <coremap.h>
+#include <pagecache.h>
+
+#define PC_DIRTY	0x1
+#define PC_BUSY		0x2
+
+struct pc_file {
+	struct vnode *pf_vnode;
+	unsigned pf_maps;		/* mappings, plus flushes running */
+	struct array *pf_pages;		/* paddr_t | PC_* per page, or 0 */
+};
+
+static struct lock *pc_lock;
+static struct cv *pc_cv;		/* a PC_BUSY page was read in */
+static struct array *pc_files;		/* struct pc_file * */
+
+#define PC_ENTRY(pf, i)	((paddr_t)(uintptr_t)array_get((pf)->pf_pages, (i)))
+#define PC_SETENTRY(pf, i, e) \
+	array_set((pf)->pf_pages, (i), (void *)(uintptr_t)(e))
+
+void
+pagecache_bootstrap(void)
+{
+	pc_lock = lock_create("pagecache");
+	pc_cv = cv_create("pagecache");
+	pc_files = array_create();
+	if (pc_lock == NULL || pc_cv == NULL || pc_files == NULL) {
+		panic("pagecache_bootstrap: out of memory\n");
+	}
+}
+
+/*
+ * Find the cache for V. Returns its index in pc_files in *INDEX if
+ * that is not NULL. The caller holds pc_lock.
+ */
+static
+struct pc_file *
+pc_find(struct vnode *v, unsigned *index)
+{
+	struct pc_file *pf;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(pc_lock));
+
+	for (i = 0; i < array_num(pc_files); i++) {
+		pf = array_get(pc_files, i);
+		if (pf->pf_vnode == v) {
+			if (index != NULL) {
+				*index = i;
+			}
+			return pf;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Write PF's dirty pages back to the file. The caller has counted
+ * itself in pf_maps, and does not hold pc_lock.
+ */
+static
+int
+pc_writeback(struct pc_file *pf)
+{
+	struct stat st;
+	struct iovec iov;
+	struct uio ku;
+	paddr_t e;
+	off_t offset;
+	size_t len;
+	unsigned i;
+	int result, err;
+
+	result = VOP_STAT(pf->pf_vnode, &st);
+	if (result) {
+		return result;
+	}
+
+	err = 0;
+	lock_acquire(pc_lock);
+	for (i = 0; i < array_num(pf->pf_pages); i++) {
+		e = PC_ENTRY(pf, i);
+		if (!(e & PC_DIRTY)) {
+			continue;
+		}
+		offset = (off_t)i * PAGE_SIZE;
+		if (offset >= st.st_size) {
+			/* Mappings don't extend the file. */
+			break;
+		}
+		len = PAGE_SIZE;
+		if (offset + PAGE_SIZE > st.st_size) {
+			len = st.st_size - offset;
+		}
+
+		/* Hold the frame, not the lock, across the write. */
+		page_share(e & PAGE_FRAME);
+		lock_release(pc_lock);
+
+		uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(e & PAGE_FRAME),
+			  len, offset, UIO_WRITE);
+		result = VOP_WRITE(pf->pf_vnode, &ku);
+		if (result && err == 0) {
+			err = result;
+		}
+
+		page_free(e & PAGE_FRAME);
+		lock_acquire(pc_lock);
+	}
+	lock_release(pc_lock);
+	return err;
+}
+
+int
+pagecache_open(struct vnode *v)
+{
+	struct pc_file *pf;
+	int result;
+
+	result = VOP_MMAP(v);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(pc_lock);
+	pf = pc_find(v, NULL);
+	if (pf == NULL) {
+		pf = kmalloc(sizeof(struct pc_file));
+		if (pf == NULL) {
+			lock_release(pc_lock);
+			return ENOMEM;
+		}
+		pf->pf_pages = array_create();
+		if (pf->pf_pages == NULL) {
+			kfree(pf);
+			lock_release(pc_lock);
+			return ENOMEM;
+		}
+		result = array_add(pc_files, pf, NULL);
+		if (result) {
+			array_destroy(pf->pf_pages);
+			kfree(pf);
+			lock_release(pc_lock);
+			return result;
+		}
+		VOP_INCREF(v);
+		pf->pf_vnode = v;
+		pf->pf_maps = 0;
+	}
+	pf->pf_maps++;
+	lock_release(pc_lock);
+	return 0;
+}
+
+void
+pagecache_close(struct vnode *v)
+{
+	struct pc_file *pf;
+	paddr_t e;
+	unsigned i, index;
+	int result;
+
+	lock_acquire(pc_lock);
+	pf = pc_find(v, &index);
+	KASSERT(pf != NULL);
+	KASSERT(pf->pf_maps > 0);
+
+	if (pf->pf_maps == 1) {
+		/* Last one: write back while we still count as a user. */
+		lock_release(pc_lock);
+		result = pc_writeback(pf);
+		if (result) {
+			kprintf("pagecache: writeback: %s\n",
+				strerror(result));
+		}
+		lock_acquire(pc_lock);
+	}
+
+	pf->pf_maps--;
+	if (pf->pf_maps > 0) {
+		/* Somebody mapped it again meanwhile. */
+		lock_release(pc_lock);
+		return;
+	}
+
+	array_remove(pc_files, index);
+	lock_release(pc_lock);
+
+	for (i = 0; i < array_num(pf->pf_pages); i++) {
+		e = PC_ENTRY(pf, i);
+		KASSERT(!(e & PC_BUSY));
+		if (e != 0) {
+			page_free(e & PAGE_FRAME);
+		}
+	}
+	array_setsize(pf->pf_pages, 0);
+	array_destroy(pf->pf_pages);
+	kfree(pf);
+	VOP_DECREF(v);
+}
+
+int
+pagecache_get(struct vnode *v, off_t offset, paddr_t *ret)
+{
+	struct pc_file *pf;
+	struct iovec iov;
+	struct uio ku;
+	unsigned i, n;
+	paddr_t e, pa;
+	int result;
+
+	KASSERT((offset & ~(off_t)PAGE_FRAME) == 0);
+
+	lock_acquire(pc_lock);
+	pf = pc_find(v, NULL);
+	KASSERT(pf != NULL);
+
+	i = offset / PAGE_SIZE;
+	n = array_num(pf->pf_pages);
+	if (i >= n) {
+		result = array_setsize(pf->pf_pages, i + 1);
+		if (result) {
+			lock_release(pc_lock);
+			return result;
+		}
+		for (; n <= i; n++) {
+			PC_SETENTRY(pf, n, 0);
+		}
+	}
+
+	while ((e = PC_ENTRY(pf, i)) & PC_BUSY) {
+		cv_wait(pc_cv, pc_lock);
+	}
+	if (e != 0) {
+		pa = e & PAGE_FRAME;
+		page_share(pa);
+		lock_release(pc_lock);
+		*ret = pa;
+		return 0;
+	}
+
+	/* Not cached: read it in without the lock. */
+	PC_SETENTRY(pf, i, PC_BUSY);
+	lock_release(pc_lock);
+
+	pa = page_alloc(NULL, 0);
+	if (pa == 0) {
+		result = ENOMEM;
+	}
+	else {
+		/* Anything past EOF stays zero. */
+		uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa), PAGE_SIZE,
+			  offset, UIO_READ);
+		result = VOP_READ(v, &ku);
+		if (result) {
+			page_free(pa);
+		}
+	}
+
+	lock_acquire(pc_lock);
+	if (result) {
+		PC_SETENTRY(pf, i, 0);
+	}
+	else {
+		PC_SETENTRY(pf, i, pa);
+		page_share(pa);
+	}
+	cv_broadcast(pc_cv, pc_lock);
+	lock_release(pc_lock);
+
+	if (result == 0) {
+		*ret = pa;
+	}
+	return result;
+}
+
+void
+pagecache_dirty(struct vnode *v, off_t offset)
+{
+	struct pc_file *pf;
+	unsigned i;
+
+	lock_acquire(pc_lock);
+	pf = pc_find(v, NULL);
+	KASSERT(pf != NULL);
+	i = offset / PAGE_SIZE;
+	KASSERT(i < array_num(pf->pf_pages));
+	KASSERT(PC_ENTRY(pf, i) != 0);
+	PC_SETENTRY(pf, i, PC_ENTRY(pf, i) | PC_DIRTY);
+	lock_release(pc_lock);
+}
+
+int
+pagecache_flush(struct vnode *v)
+{
+	struct pc_file *pf;
+	int result;
+
+	lock_acquire(pc_lock);
+	pf = pc_find(v, NULL);
+	if (pf == NULL) {
+		lock_release(pc_lock);
+		return 0;
+	}
+	pf->pf_maps++;
+	lock_release(pc_lock);
+
+	result = pc_writeback(pf);
+	pagecache_close(v);
+	return result;
+}
@@ -0,0 +1,137 @@
+/*
+ * Two-level page tables for user address spaces.
+ * See pagetable.h for the layout.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pagetable.h>
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+
+	pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+	bzero(pt, sizeof(struct pagetable));
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i, j;
+	pte_t *table;
+
+	for (i = 0; i < PT_ENTRIES; i++) {
+		table = pt->pt_dir[i];
+		if (table == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_ENTRIES; j++) {
+			if (table[j] & PTE_VALID) {
+				page_free(table[j] & PTE_FRAME);
+			}
+			else if (table[j] & PTE_SWAPPED) {
+				swap_free(PTE_SWAPSLOT(table[j]));
+			}
+		}
+		kfree(table);
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t *table;
+
+	table = pt->pt_dir[PT_DIRINDEX(vaddr)];
+	if (table == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		table = kmalloc(PT_ENTRIES * sizeof(pte_t));
+		if (table == NULL) {
+			return NULL;
+		}
+		bzero(table, PT_ENTRIES * sizeof(pte_t));
+		pt->pt_dir[PT_DIRINDEX(vaddr)] = table;
+	}
+	return &table[PT_TABINDEX(vaddr)];
+}
+
+void
+pt_clear(struct pagetable *pt, vaddr_t start, vaddr_t end)
+{
+	vaddr_t va, next;
+	pte_t *pte;
+
+	KASSERT((start & PAGE_FRAME) == start);
+	KASSERT((end & PAGE_FRAME) == end);
+	KASSERT(end <= USERSPACETOP);
+
+	for (va = start; va < end; va = next) {
+		next = va + PAGE_SIZE;
+		pte = pt_lookup(pt, va, false);
+		if (pte == NULL) {
+			/* No table: skip the rest of its 4M slice. */
+			next = (va & ~(vaddr_t)0x3fffff) + 0x400000;
+			continue;
+		}
+		if (*pte & PTE_VALID) {
+			page_free(*pte & PTE_FRAME);
+		}
+		else if (*pte & PTE_SWAPPED) {
+			swap_free(PTE_SWAPSLOT(*pte));
+		}
+		*pte = 0;
+	}
+}
+
+int
+pt_copy(struct pagetable *old, struct pagetable *new)
+{
+	unsigned i, j;
+	pte_t *oldtable, *newtable;
+
+	for (i = 0; i < PT_ENTRIES; i++) {
+		oldtable = old->pt_dir[i];
+		if (oldtable == NULL) {
+			continue;
+		}
+		KASSERT(new->pt_dir[i] == NULL);
+		newtable = kmalloc(PT_ENTRIES * sizeof(pte_t));
+		if (newtable == NULL) {
+			return ENOMEM;
+		}
+		bzero(newtable, PT_ENTRIES * sizeof(pte_t));
+		new->pt_dir[i] = newtable;
+
+		for (j = 0; j < PT_ENTRIES; j++) {
+			if (oldtable[j] & PTE_SWAPPED) {
+				swap_share(PTE_SWAPSLOT(oldtable[j]));
+				newtable[j] = oldtable[j];
+				continue;
+			}
+			if (!(oldtable[j] & PTE_VALID)) {
+				continue;
+			}
+			if ((oldtable[j] & PTE_WRITE) &&
+			    !(oldtable[j] & PTE_SHARED)) {
+				oldtable[j] &= ~PTE_WRITE;
+				oldtable[j] |= PTE_COW;
+			}
+			page_share(oldtable[j] & PTE_FRAME);
+			newtable[j] = oldtable[j];
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * Swap space and page-out. See swap.h for the interface.
+ *
+ * Paging out a frame goes:
+ *
+ *    1. page_evict_select runs the clock and marks the victim busy.
+ *    2. Take the owner's address space lock (skipping the victim if
+ *       that would block) and check that the frame is still the owner's
+ *       alone and still mapped where the coremap says (a fork, exit or
+ *       fault may have got there first).
+ *    3. Point the PTE at a fresh swap slot, so that any new fault on
+ *       the page blocks on the lock, and shoot the old translation
+ *       out of every TLB.
+ *    4. Write the frame out and free it.
+ *
+ * The address space lock is held across the write. Its owner can do
+ * nothing with the page in the meantime anyway, and it keeps as_destroy
+ * from pulling the page table out from under us.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <stat.h>
+#include <addrspace.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+
+static struct vnode *swap_vnode = NULL;
+static unsigned swap_nslots = 0;
+
+/* Slot allocation. */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct bitmap *swap_map;
+static uint16_t *swap_refs;
+
+/* The pageout thread sleeps on this. */
+static struct semaphore *pageout_sem = NULL;
+static volatile bool pageout_pending = false;
+
+static
+void
+pageout_thread(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		P(pageout_sem);
+		pageout_pending = false;
+
+		while (coremap_freecount() < PAGEOUT_HIGH) {
+			if (swap_pageout()) {
+				break;
+			}
+		}
+	}
+}
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;
+	struct stat st;
+	int result;
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: %s: stat: %s\n", SWAP_DEVICE, strerror(result));
+	}
+	swap_nslots = st.st_size / PAGE_SIZE;
+	if (swap_nslots == 0) {
+		kprintf("swap: %s is too small; running without swap\n",
+			SWAP_DEVICE);
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	swap_map = bitmap_create(swap_nslots);
+	swap_refs = kmalloc(swap_nslots * sizeof(uint16_t));
+	pageout_sem = sem_create("pageout", 0);
+	if (swap_map == NULL || swap_refs == NULL || pageout_sem == NULL) {
+		panic("swap_bootstrap: out of memory\n");
+	}
+	bzero(swap_refs, swap_nslots * sizeof(uint16_t));
+
+	result = thread_fork("pageout", NULL, pageout_thread, NULL, 0);
+	if (result) {
+		panic("swap_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+
+	kprintf("swap: %u slots (%uk) on %s\n", swap_nslots,
+		swap_nslots * PAGE_SIZE / 1024, SWAP_DEVICE);
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	if (result == 0) {
+		KASSERT(swap_refs[*slot] == 0);
+		swap_refs[*slot] = 1;
+	}
+	spinlock_release(&swap_lock);
+	return result;
+}
+
+void
+swap_share(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refs[slot] > 0 && swap_refs[slot] < 0xffff);
+	swap_refs[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refs[slot] > 0);
+	swap_refs[slot]--;
+	if (swap_refs[slot] == 0) {
+		bitmap_unmark(swap_map, slot);
+	}
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Move one page between a frame and a slot.
+ */
+static
+int
+swap_io(paddr_t paddr, unsigned slot, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		return VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		return VOP_WRITE(swap_vnode, &ku);
+	}
+}
+
+int
+swap_read(paddr_t paddr, unsigned slot)
+{
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	return swap_io(paddr, slot, UIO_READ);
+}
+
+int
+swap_readv(const paddr_t *paddrs, unsigned slot, unsigned n)
+{
+	struct iovec iov[VM_RAMAX];
+	struct uio ku;
+	unsigned i;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(n > 0 && n <= VM_RAMAX);
+	KASSERT(slot + n <= swap_nslots);
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(paddrs[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)slot * PAGE_SIZE;
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_READ;
+	ku.uio_space = NULL;
+
+	/* One fault, however many pages. */
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	return VOP_READ(swap_vnode, &ku);
+}
+
+int
+swap_write(paddr_t paddr, unsigned slot)
+{
+	vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	return swap_io(paddr, slot, UIO_WRITE);
+}
+
+int
+swap_pageout(void)
+{
+	struct addrspace *as;
+	vaddr_t vaddr;
+	paddr_t pa;
+	pte_t *pte, oldpte;
+	unsigned slot;
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	pa = page_evict_select(&as, &vaddr);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+
+	/*
+	 * Never sleep on the owner's lock: the owner may be blocked in the
+	 * file system (reading an executable page) behind a lock that our
+	 * own caller holds. Just pick another victim.
+	 */
+	if (!lock_tryacquire(as->as_lock)) {
+		page_evict_done(pa, as, false);
+		return 0;
+	}
+
+	if (as->as_pt == NULL || !page_evict_check(pa, as)) {
+		/* Exited, forked, or freed the page; try another. */
+		lock_release(as->as_lock);
+		page_evict_done(pa, as, false);
+		return 0;
+	}
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	if (pte == NULL || (*pte & (PTE_VALID | PTE_FRAME)) != (pa | PTE_VALID)) {
+		/* Allocated by a fault that hasn't mapped it yet. */
+		lock_release(as->as_lock);
+		page_evict_done(pa, as, false);
+		return 0;
+	}
+
+	result = swap_alloc(&slot);
+	if (result) {
+		lock_release(as->as_lock);
+		page_evict_done(pa, as, false);
+		return result;
+	}
+
+	oldpte = *pte;
+	*pte = PTE_MKSWAP(slot) | (oldpte & (PTE_WRITE | PTE_COW));
+	vm_tlbshootdown_wait(as, vaddr);
+
+	result = swap_write(pa, slot);
+	if (result) {
+		kprintf("swap: write to slot %u: %s\n", slot, strerror(result));
+		*pte = oldpte;
+		swap_free(slot);
+		lock_release(as->as_lock);
+		page_evict_done(pa, as, false);
+		return result;
+	}
+
+	lock_release(as->as_lock);
+	page_evict_done(pa, as, true);
+	return 0;
+}
+
+void
+swap_wakeup(void)
+{
+	if (pageout_sem == NULL || pageout_pending) {
+		return;
+	}
+	pageout_pending = true;
+	V(pageout_sem);
+}
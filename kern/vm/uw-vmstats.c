@@ -33,6 +33,9 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "TLB Prefetches",
+ /* 11 */ "Read-around Pages",
+ /* 12 */ "Read-around Hits",
 };
 
 
@@ -0,0 +1,1201 @@
+/*
+ * Paging VM system: fault handling and TLB management.
+ *
+ * Every TLB miss on a user address comes here. If the address lies in
+ * one of the address space's regions, the page table is consulted; a
+ * page that has never been touched gets a fresh zero-filled frame,
+ * and the resulting mapping is loaded into the TLB.
+ *
+ * After fork, parent and child share their writable frames read-only
+ * (PTE_COW). The first write by either side takes a VM_FAULT_READONLY
+ * (or a write miss), and vm_cow_break gives the writer its own frame.
+ *
+ * Pages of the executable are read from the vnode on first touch;
+ * load_elf only records where each segment lies in the file.
+ *
+ * Pages of a region made by mmap come from the page cache. A shared
+ * mapping maps the cached frame itself (PTE_SHARED), read-only until
+ * the first write marks the page dirty in the cache. A private mapping
+ * maps it copy-on-write, like a page shared after fork.
+ *
+ * The first touch of a page that would just be zero-filled, if it is
+ * a read, maps the zero page: one pinned, always-zero frame shared by
+ * every such mapping, copy-on-write if the page is writable. Only a
+ * write gets the page a frame of its own. Until the loader is done,
+ * every page gets its own frame, since the loader's entries are
+ * writable regardless.
+ *
+ * A page that has been paged out (PTE_SWAPPED) is read back from swap
+ * into a new frame. Getting a frame may itself mean paging out some
+ * other page, which needs that page's address space lock, so frames
+ * are always allocated with our own address space lock released.
+ *
+ * A fault that has to read the disk reads around: the pages after the
+ * faulting one that would also come from the same place (the next
+ * slots in swap, or the rest of a segment in the executable) are read
+ * in the same request, so long as frames are free without paging
+ * anything out (page_tryalloc). How far to read is adapted per address
+ * space: on each disk fault, the pages read ahead last time are
+ * checked, and the window doubles if at least half of them have been
+ * used and halves otherwise. Read-ahead pages start out unreferenced,
+ * so "used" is the clock's referenced bit.
+ *
+ * User translations are tagged with an ASID, so that the TLB need not
+ * be flushed on every context switch. Each cpu hands out ASIDs in
+ * order, counting in c_asid_last; the bits above the 6-bit ASID are a
+ * generation number. An address space's ASID on a cpu (as_asid) is
+ * good only while its generation is current there. When the ASIDs run
+ * out, the cpu flushes its TLB and starts a new generation, which
+ * makes every address space pick up a fresh ASID when next activated.
+ * An ASID is never handed out twice in one generation, so retiring an
+ * address space's ASIDs is enough to make its old entries unreachable.
+ *
+ * When a miss finds the TLB full, the entry to replace is chosen by
+ * the policy configured in: tlb_random by default, round-robin with
+ * "options tlbrr", or pseudo-LRU with "options tlblru". The hardware
+ * doesn't tell us about TLB hits, so pseudo-LRU counts an entry as
+ * used when it is loaded or rewritten; what it avoids is throwing out
+ * the entries most recently faulted in, which random replacement does
+ * as readily as any other.
+ *
+ * With "options tlbprefetch", a miss that does come here also loads
+ * the resident pages around the faulting one, in the naturally aligned
+ * block of VM_PREFETCH pages containing it. MIPS-I has no large pages,
+ * so this is the nearest thing: sequential sweeps over big arrays take
+ * one slow miss per block rather than per page. Prefetched entries are
+ * counted in VMSTAT_TLB_PREFETCH, not as faults.
+ *
+ * Most misses never get here. The UTLB refill handler in
+ * exception-mips1.S walks the current page table itself and loads any
+ * resident page with tlbwr; only misses on pages that are not resident
+ * (or that the loader may still write) come through mips_trap. That
+ * handler can only replace at random, so it is switched off when
+ * another policy is configured.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <array.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <cpu.h>
+#include <proc.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <platform/maxcpus.h>
+#include <addrspace.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <vm.h>
+#include <uw-vmstats.h>
+#include "opt-tlbrr.h"
+#include "opt-tlblru.h"
+#include "opt-tlbprefetch.h"
+#include "opt-kstack.h"
+
+#if OPT_KSTACK
+#include <kstack.h>
+#endif
+
+#if OPT_TLBRR && OPT_TLBLRU
+#error "Pick at most one TLB replacement policy"
+#endif
+
+/* TLB slots below this hold the running kernel stacks; see kstack.h. */
+#if OPT_KSTACK
+#define VM_TLB_FIRST	KSTACK_TLBSLOTS
+#else
+#define VM_TLB_FIRST	0
+#endif
+
+#define ASID_MASK	(NUM_ASID - 1)
+#define ASID_GEN(a)	((a) & ~(uint32_t)ASID_MASK)
+
+#if OPT_TLBRR
+static const char *const vm_tlb_policy = "round-robin";
+#elif OPT_TLBLRU
+static const char *const vm_tlb_policy = "pseudo-LRU";
+#else
+static const char *const vm_tlb_policy = "random";
+#define VM_FASTREFILL	1
+#endif
+
+/* See pagetable.h. Written only by the cpu concerned, except to clear. */
+pte_t **vm_curpagedir[MAXCPUS];
+unsigned vm_fastrefills[MAXCPUS];
+
+/*
+ * Shootdowns that have to be waited for are done one at a time, so
+ * no cpu ever has more than one of them queued and ipi_tlbshootdown
+ * never collapses them into a TLBSHOOTDOWN_ALL (which would lose
+ * ts_done).
+ */
+static struct lock *vm_shootdown_lock;
+static struct semaphore *vm_shootdown_sem;
+
+/* The zero page. */
+static paddr_t vm_zeropage;
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	vmstats_init();
+#if OPT_KSTACK
+	kstack_bootstrap();
+#endif
+
+	vm_shootdown_lock = lock_create("vm_shootdown");
+	vm_shootdown_sem = sem_create("vm_shootdown", 0);
+	if (vm_shootdown_lock == NULL || vm_shootdown_sem == NULL) {
+		panic("vm_bootstrap: out of memory\n");
+	}
+
+	vm_zeropage = page_alloc(NULL, 0);
+	if (vm_zeropage == 0) {
+		panic("vm_bootstrap: no memory for the zero page\n");
+	}
+	page_pin(vm_zeropage);
+
+	swap_bootstrap();
+	pagecache_bootstrap();
+
+	kprintf("vm: %s TLB replacement\n", vm_tlb_policy);
+}
+
+/*
+ * Put the active ASID back into ENTRYHI after the TLB routines have
+ * clobbered it. Interrupts must be off.
+ */
+void
+vm_asid_restore(void)
+{
+	tlb_setasid(curcpu->c_asid_cur & ASID_MASK);
+}
+
+/*
+ * ENTRYHI for VADDR in the active address space. Interrupts must be
+ * off, so that we stay on this cpu.
+ */
+static
+uint32_t
+vm_tlb_ehi(vaddr_t vaddr)
+{
+	return (vaddr & TLBHI_VPAGE) |
+		((curcpu->c_asid_cur & ASID_MASK) << TLBHI_PIDSHIFT);
+}
+
+void
+vm_tlb_flush(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	for (i=VM_TLB_FIRST; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	vm_asid_restore();
+	splx(spl);
+}
+
+void
+vm_asid_activate(struct addrspace *as)
+{
+	struct cpu *c;
+	uint32_t asid;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	asid = as->as_asid[c->c_number];
+	if (asid == 0 || ASID_GEN(asid) != ASID_GEN(c->c_asid_last)) {
+		asid = ++c->c_asid_last;
+		if ((asid & ASID_MASK) == 0) {
+			/* Out of ASIDs; start a new generation. */
+			vm_tlb_flush();
+			vmstats_inc(VMSTAT_TLB_INVALIDATE);
+			if (asid == 0) {
+				/* The generation count wrapped; 0 means none. */
+				asid = ++c->c_asid_last;
+			}
+		}
+		as->as_asid[c->c_number] = asid;
+	}
+
+	c->c_asid_cur = asid;
+	vm_asid_restore();
+
+#ifdef VM_FASTREFILL
+	/* Until the loader is done, all misses need the DIRTY override. */
+	vm_curpagedir[c->c_number] =
+		as->loadelf_finish ? as->as_pt->pt_dir : NULL;
+#endif
+	splx(spl);
+}
+
+void
+vm_refill_forget(struct addrspace *as)
+{
+	unsigned i;
+
+	/*
+	 * AS isn't running anywhere but maybe here, and other cpus may
+	 * still point at its table from before they last switched.
+	 */
+	for (i = 0; i < MAXCPUS; i++) {
+		if (vm_curpagedir[i] == as->as_pt->pt_dir) {
+			vm_curpagedir[i] = NULL;
+		}
+	}
+}
+
+void
+vm_printstats(void)
+{
+	unsigned i, total;
+
+	total = 0;
+	for (i = 0; i < MAXCPUS; i++) {
+		total += vm_fastrefills[i];
+	}
+	kprintf("vm: %s TLB replacement, %u misses refilled "
+		"without vm_fault\n", vm_tlb_policy, total);
+}
+
+void
+vm_asid_retire(struct addrspace *as)
+{
+	unsigned i;
+
+	for (i = 0; i < MAXCPUS; i++) {
+		as->as_asid[i] = 0;
+	}
+}
+
+
+/*
+ * Pseudo-LRU over the NUM_TLB slots is a binary tree kept in the bits
+ * of c_tlb_plru, heap-ordered from bit 1. Each node's bit says which
+ * half holds the less recently used slots.
+ */
+#define PLRU_LEVELS	6
+#if (1 << PLRU_LEVELS) != NUM_TLB
+#error "PLRU_LEVELS doesn't match NUM_TLB"
+#endif
+
+/*
+ * Record a use of TLB slot I. Interrupts must be off.
+ */
+static
+void
+vm_tlb_touch(int i)
+{
+#if OPT_TLBLRU
+	unsigned node, level, dir;
+	uint64_t *tree;
+
+	tree = &curcpu->c_tlb_plru;
+	node = 1;
+	for (level = PLRU_LEVELS; level-- > 0; ) {
+		dir = (i >> level) & 1;
+		/* Point this node away from the half we just used. */
+		if (dir) {
+			*tree &= ~((uint64_t)1 << node);
+		}
+		else {
+			*tree |= (uint64_t)1 << node;
+		}
+		node = node * 2 + dir;
+	}
+#else
+	(void)i;
+#endif
+}
+
+/*
+ * Choose the slot to replace in a full TLB, or -1 to let tlb_random
+ * choose. Interrupts must be off.
+ */
+static
+int
+vm_tlb_victim(void)
+{
+#if OPT_TLBRR
+	int i;
+
+	i = curcpu->c_tlb_hand;
+	if (i < VM_TLB_FIRST) {
+		i = VM_TLB_FIRST;
+	}
+	curcpu->c_tlb_hand = (i + 1) % NUM_TLB;
+	return i;
+#elif OPT_TLBLRU
+	unsigned node, level, dir;
+	uint64_t tree;
+	int i;
+
+	do {
+		tree = curcpu->c_tlb_plru;
+		node = 1;
+		i = 0;
+		for (level = 0; level < PLRU_LEVELS; level++) {
+			dir = (tree >> node) & 1;
+			i = i * 2 + dir;
+			node = node * 2 + dir;
+		}
+		/* Steer the tree away from the reserved slots. */
+		if (i < VM_TLB_FIRST) {
+			vm_tlb_touch(i);
+		}
+	} while (i < VM_TLB_FIRST);
+	return i;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Put a translation for VADDR in the active address space into the
+ * TLB, preferring an invalid slot over evicting a live one. Returns
+ * true if there was an invalid slot. Interrupts must be off.
+ */
+static
+bool
+vm_tlb_insert(vaddr_t vaddr, uint32_t elo)
+{
+	uint32_t ehi, oldhi, oldlo;
+	int i;
+
+	ehi = vm_tlb_ehi(vaddr);
+
+	for (i=VM_TLB_FIRST; i<NUM_TLB; i++) {
+		tlb_read(&oldhi, &oldlo, i);
+		if (oldlo & TLBLO_VALID) {
+			continue;
+		}
+		tlb_write(ehi, elo, i);
+		vm_tlb_touch(i);
+		return true;
+	}
+
+	i = vm_tlb_victim();
+	if (i < 0) {
+		tlb_random(ehi, elo);
+	}
+	else {
+		tlb_write(ehi, elo, i);
+		vm_tlb_touch(i);
+	}
+	return false;
+}
+
+/*
+ * Load a translation for VADDR after a miss on it.
+ */
+static
+void
+vm_tlb_load(vaddr_t vaddr, uint32_t elo)
+{
+	int spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	if (vm_tlb_insert(vaddr, elo)) {
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+	}
+	else {
+		vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+	}
+	splx(spl);
+}
+
+#if OPT_TLBPREFETCH
+
+/* Pages per prefetch block; a power of two. */
+#define VM_PREFETCH	4
+
+/*
+ * Collect the resident neighbours of VADDR in its prefetch block,
+ * with their TLBLO words, into VADDRS and ELOS. Returns how many.
+ * Pages not referenced lately are left out: loading them would count
+ * as a use, both to the clock and to read-around's hit rate. The
+ * caller holds the address space lock.
+ */
+static
+unsigned
+vm_prefetch_collect(struct addrspace *as, vaddr_t vaddr,
+		    vaddr_t *vaddrs, uint32_t *elos)
+{
+	vaddr_t base, va;
+	pte_t *pte;
+	unsigned n;
+
+	base = vaddr & ~(vaddr_t)(VM_PREFETCH * PAGE_SIZE - 1);
+	n = 0;
+	for (va = base; va < base + VM_PREFETCH * PAGE_SIZE; va += PAGE_SIZE) {
+		if (va == vaddr) {
+			continue;
+		}
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || !(*pte & PTE_VALID) ||
+		    !page_touched(*pte & PTE_FRAME)) {
+			continue;
+		}
+		vaddrs[n] = va;
+		elos[n] = *pte & PTE_TLBMASK;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Load the N translations collected by vm_prefetch_collect, skipping
+ * any that are already in the TLB. The caller still holds the address
+ * space lock it collected them under.
+ */
+static
+void
+vm_tlb_prefetch(const vaddr_t *vaddrs, const uint32_t *elos, unsigned n)
+{
+	unsigned i;
+	int spl;
+
+	spl = splhigh();
+	for (i = 0; i < n; i++) {
+		if (tlb_probe(vm_tlb_ehi(vaddrs[i]), 0) >= 0) {
+			continue;
+		}
+		vm_tlb_insert(vaddrs[i], elos[i]);
+		vmstats_inc(VMSTAT_TLB_PREFETCH);
+	}
+	splx(spl);
+}
+
+#endif /* OPT_TLBPREFETCH */
+
+/*
+ * Remove VADDR in AS from this cpu's TLB, if it is there. Only entries
+ * tagged with AS's current ASID here can be; older ones are unreachable.
+ * Interrupts must be off.
+ */
+static
+void
+vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+	uint32_t asid;
+	int i;
+
+	asid = as->as_asid[curcpu->c_number];
+	if (asid == 0 || ASID_GEN(asid) != ASID_GEN(curcpu->c_asid_last)) {
+		return;
+	}
+
+	i = tlb_probe((vaddr & TLBHI_VPAGE) |
+		      ((asid & ASID_MASK) << TLBHI_PIDSHIFT), 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	vm_asid_restore();
+}
+
+/*
+ * Does a fault of type FAULTTYPE on PTE, in REG, need a new frame?
+ * ZEROOK says whether an untouched page may map the zero page.
+ */
+static
+bool
+vm_needs_frame(struct as_region *reg, pte_t pte, int faulttype, bool zerook)
+{
+	if (pte == 0 && zerook) {
+		return false;
+	}
+	if (pte == 0 && reg->ar_mapvnode != NULL) {
+		/* Only to copy a private file page straight away. */
+		return !(reg->ar_perm & AR_SHARED) &&
+			faulttype != VM_FAULT_READ;
+	}
+	if (!(pte & PTE_VALID)) {
+		return true;
+	}
+	return faulttype != VM_FAULT_READ && (pte & PTE_COW) &&
+		page_refcount(pte & PTE_FRAME) > 1;
+}
+
+/*
+ * Lock AS and look up the PTE for VADDR in REG, first putting into
+ * *SPARE any frame the fault is going to need, and into *FILEPA a
+ * reference to the page cache's frame for a mapped file page not yet
+ * mapped. ZEROOK is as for vm_needs_frame. Returns with the lock held,
+ * or with it released and an error.
+ */
+static
+int
+vm_lookup_locked(struct addrspace *as, struct as_region *reg, vaddr_t vaddr,
+		 int faulttype, bool zerook, pte_t **ret, paddr_t *spare,
+		 paddr_t *filepa)
+{
+	pte_t *pte;
+	int result;
+
+	lock_acquire(as->as_lock);
+	while (1) {
+		pte = pt_lookup(as->as_pt, vaddr, true);
+		if (pte == NULL) {
+			lock_release(as->as_lock);
+			return ENOMEM;
+		}
+		if (*pte == 0 && reg->ar_mapvnode != NULL && *filepa == 0) {
+			/* Reading the file may page out; do it unlocked. */
+			lock_release(as->as_lock);
+			result = pagecache_get(reg->ar_mapvnode,
+					       reg->ar_mapoffset +
+					       (vaddr - reg->ar_vbase), filepa);
+			if (result) {
+				return result;
+			}
+			lock_acquire(as->as_lock);
+			continue;
+		}
+		if (*spare != 0 ||
+		    !vm_needs_frame(reg, *pte, faulttype, zerook)) {
+			break;
+		}
+
+		/* Allocate unlocked, then look again. */
+		lock_release(as->as_lock);
+		*spare = page_alloc(as, vaddr);
+		if (*spare == 0) {
+			return ENOMEM;
+		}
+		lock_acquire(as->as_lock);
+	}
+	*ret = pte;
+	return 0;
+}
+
+/*
+ * Give the page behind PTE a private, writable frame. If nobody else
+ * maps the frame any more it is simply made writable; otherwise its
+ * contents are copied into *SPARE and our reference to the shared
+ * frame dropped. The caller holds the address space lock.
+ */
+static
+void
+vm_cow_break(struct addrspace *as, vaddr_t vaddr, pte_t *pte, paddr_t *spare)
+{
+	paddr_t oldpa, newpa;
+
+	KASSERT(*pte & PTE_VALID);
+	KASSERT(*pte & PTE_COW);
+
+	oldpa = *pte & PTE_FRAME;
+	if (page_refcount(oldpa) > 1) {
+		/* Nobody else can add a reference while we hold the lock. */
+		KASSERT(*spare != 0);
+		newpa = *spare;
+		*spare = 0;
+		memmove((void *)PADDR_TO_KVADDR(newpa),
+			(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+		page_free(oldpa);
+		*pte = newpa | (*pte & ~PTE_FRAME);
+	}
+	else {
+		page_claim(oldpa, as, vaddr);
+	}
+	*pte &= ~PTE_COW;
+	*pte |= PTE_WRITE;
+}
+
+/*
+ * A write to the shared file page behind PTE: if REG allows writing,
+ * mark the page dirty in the page cache and make it writable. The
+ * caller holds the address space lock.
+ */
+static
+void
+vm_shared_write(struct as_region *reg, vaddr_t vaddr, pte_t *pte)
+{
+	KASSERT(*pte & PTE_SHARED);
+
+	if ((*pte & PTE_WRITE) || !(reg->ar_perm & AR_WRITE)) {
+		return;
+	}
+	pagecache_dirty(reg->ar_mapvnode,
+			reg->ar_mapoffset + (vaddr - reg->ar_vbase));
+	*pte |= PTE_WRITE;
+}
+
+/*
+ * Clip the part of REG that comes from the executable to the page at
+ * VADDR. Returns false if none of the page does.
+ */
+static
+bool
+vm_exec_range(struct as_region *reg, vaddr_t vaddr,
+	      vaddr_t *startp, vaddr_t *endp)
+{
+	vaddr_t start, end;
+
+	start = reg->ar_filevaddr;
+	end = start + reg->ar_filesize;
+	if (start < vaddr) {
+		start = vaddr;
+	}
+	if (end > vaddr + PAGE_SIZE) {
+		end = vaddr + PAGE_SIZE;
+	}
+	*startp = start;
+	*endp = end;
+	return start < end;
+}
+
+/*
+ * Could the first touch of page VADDR in REG, a fault of FAULTTYPE,
+ * map the zero page? Only if it is a read, and nothing but zeroes
+ * would go in the page.
+ */
+static
+bool
+vm_zero_ok(struct addrspace *as, struct as_region *reg, vaddr_t vaddr,
+	   int faulttype)
+{
+	vaddr_t start, end;
+	unsigned i;
+
+	if (faulttype != VM_FAULT_READ || !as->loadelf_finish ||
+	    reg->ar_mapvnode != NULL) {
+		return false;
+	}
+	for (i = 0; i < array_num(as->as_regions); i++) {
+		if (vm_exec_range(array_get(as->as_regions, i), vaddr,
+				  &start, &end)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Fill in the new, zeroed frame PA for page VADDR with whatever parts
+ * of the executable belong there. A page can hold the ends of two
+ * segments, so look at every region. Sets *DIDREAD if anything was
+ * read. The caller holds the address space lock.
+ */
+static
+int
+vm_read_exec(struct addrspace *as, vaddr_t vaddr, paddr_t pa, bool *didread)
+{
+	struct as_region *reg;
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	unsigned i;
+	int result;
+
+	*didread = false;
+	for (i = 0; i < array_num(as->as_regions); i++) {
+		reg = array_get(as->as_regions, i);
+		if (!vm_exec_range(reg, vaddr, &start, &end)) {
+			continue;
+		}
+
+		if (!*didread) {
+			vmstats_inc(VMSTAT_ELF_FILE_READ);
+			*didread = true;
+		}
+		uio_kinit(&iov, &ku,
+			  (void *)(PADDR_TO_KVADDR(pa) + (start - vaddr)),
+			  end - start,
+			  reg->ar_fileoffset + (start - reg->ar_filevaddr),
+			  UIO_READ);
+		result = VOP_READ(as->as_vnode, &ku);
+		if (result) {
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			kprintf("vm: short read from executable - "
+				"file truncated?\n");
+			return ENOEXEC;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check how many of the pages AS read ahead last time have been used,
+ * and adjust its read-around window. The caller holds the lock.
+ */
+static
+void
+vm_ra_account(struct addrspace *as)
+{
+	pte_t *pte;
+	unsigned i, hits;
+
+	if (as->as_ra_num == 0) {
+		return;
+	}
+
+	hits = 0;
+	for (i = 0; i < as->as_ra_num; i++) {
+		pte = pt_lookup(as->as_pt, as->as_ra_vaddr[i], false);
+		if (pte != NULL &&
+		    (*pte & (PTE_VALID | PTE_FRAME)) ==
+		    (as->as_ra_paddr[i] | PTE_VALID) &&
+		    page_touched(as->as_ra_paddr[i])) {
+			hits++;
+			vmstats_inc(VMSTAT_READAROUND_HIT);
+		}
+	}
+
+	if (hits * 2 >= as->as_ra_num) {
+		if (as->as_ra_window < VM_RAMAX) {
+			as->as_ra_window *= 2;
+		}
+	}
+	else if (as->as_ra_window > VM_RAMIN) {
+		as->as_ra_window /= 2;
+	}
+	as->as_ra_num = 0;
+}
+
+/*
+ * Remember the read-ahead page VADDR, in frame PA, so that the next
+ * disk fault can see whether it was used.
+ */
+static
+void
+vm_ra_record(struct addrspace *as, vaddr_t vaddr, paddr_t pa)
+{
+	KASSERT(as->as_ra_num < VM_RAMAX);
+
+	page_untouch(pa);
+	as->as_ra_vaddr[as->as_ra_num] = vaddr;
+	as->as_ra_paddr[as->as_ra_num] = pa;
+	as->as_ra_num++;
+	vmstats_inc(VMSTAT_READAROUND);
+}
+
+/*
+ * Bring the paged-out page VADDR in REG, whose entry is PTE, back into
+ * frame PA, and with it as many of the following pages as are in the
+ * following swap slots and fit in the window. The caller holds the
+ * address space lock.
+ */
+static
+int
+vm_swap_in(struct addrspace *as, struct as_region *reg, vaddr_t vaddr,
+	   pte_t *pte, paddr_t pa)
+{
+	paddr_t pas[VM_RAMAX];
+	pte_t *ptes[VM_RAMAX];
+	vaddr_t va, end;
+	unsigned slot, i, n;
+	int result;
+
+	vm_ra_account(as);
+
+	slot = PTE_SWAPSLOT(*pte);
+	pas[0] = pa;
+	ptes[0] = pte;
+	n = 1;
+	end = reg->ar_vbase + reg->ar_npages * PAGE_SIZE;
+	for (va = vaddr + PAGE_SIZE; n < as->as_ra_window && va < end;
+	     va += PAGE_SIZE) {
+		ptes[n] = pt_lookup(as->as_pt, va, false);
+		if (ptes[n] == NULL || !(*ptes[n] & PTE_SWAPPED) ||
+		    PTE_SWAPSLOT(*ptes[n]) != slot + n) {
+			break;
+		}
+		pas[n] = page_tryalloc(as, va);
+		if (pas[n] == 0) {
+			break;
+		}
+		n++;
+	}
+
+	result = swap_readv(pas, slot, n);
+	if (result) {
+		for (i = 1; i < n; i++) {
+			page_free(pas[i]);
+		}
+		return result;
+	}
+
+	for (i = 0; i < n; i++) {
+		swap_free(PTE_SWAPSLOT(*ptes[i]));
+		*ptes[i] = pas[i] | PTE_VALID |
+			(*ptes[i] & (PTE_WRITE | PTE_COW));
+		if (i > 0) {
+			vm_ra_record(as, vaddr + i * PAGE_SIZE, pas[i]);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read page VADDR of REG from the executable into frame PA, and with
+ * it as many of the following untouched pages as fit in the window,
+ * in one request. This only handles pages that lie wholly inside the
+ * region's part of the file; returns false, having done nothing, for
+ * any other. The caller holds the address space lock.
+ */
+static
+bool
+vm_exec_in(struct addrspace *as, struct as_region *reg, vaddr_t vaddr,
+	   pte_t *pte, paddr_t pa, int *result)
+{
+	struct iovec iov[VM_RAMAX];
+	struct uio ku;
+	paddr_t pas[VM_RAMAX];
+	pte_t *ptes[VM_RAMAX];
+	vaddr_t va, fileend;
+	pte_t bits;
+	unsigned i, n;
+
+	fileend = reg->ar_filevaddr + reg->ar_filesize;
+	if (vaddr < reg->ar_filevaddr || vaddr + PAGE_SIZE > fileend) {
+		return false;
+	}
+
+	vm_ra_account(as);
+
+	pas[0] = pa;
+	ptes[0] = pte;
+	n = 1;
+	for (va = vaddr + PAGE_SIZE;
+	     n < as->as_ra_window && va + PAGE_SIZE <= fileend;
+	     va += PAGE_SIZE) {
+		ptes[n] = pt_lookup(as->as_pt, va, false);
+		if (ptes[n] == NULL || *ptes[n] != 0) {
+			break;
+		}
+		pas[n] = page_tryalloc(as, va);
+		if (pas[n] == 0) {
+			break;
+		}
+		n++;
+	}
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(pas[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = reg->ar_fileoffset + (vaddr - reg->ar_filevaddr);
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_READ;
+	ku.uio_space = NULL;
+
+	vmstats_inc(VMSTAT_ELF_FILE_READ);
+	*result = VOP_READ(as->as_vnode, &ku);
+	if (*result == 0 && ku.uio_resid != 0) {
+		kprintf("vm: short read from executable - "
+			"file truncated?\n");
+		*result = ENOEXEC;
+	}
+	if (*result) {
+		for (i = 1; i < n; i++) {
+			page_free(pas[i]);
+		}
+		return true;
+	}
+
+	bits = PTE_VALID;
+	if (reg->ar_perm & AR_WRITE) {
+		bits |= PTE_WRITE;
+	}
+	for (i = 0; i < n; i++) {
+		*ptes[i] = pas[i] | bits;
+		if (i > 0) {
+			vm_ra_record(as, vaddr + i * PAGE_SIZE, pas[i]);
+		}
+	}
+	return true;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct as_region *reg;
+	pte_t *pte;
+	paddr_t pa, spare, filepa;
+	uint32_t elo;
+	bool didread;
+	int i, spl, result;
+#if OPT_TLBPREFETCH
+	vaddr_t prevaddrs[VM_PREFETCH];
+	uint32_t preelos[VM_PREFETCH];
+	unsigned npre = 0;
+#endif
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	reg = as_find_region(as, faultaddress);
+	if (reg == NULL) {
+		return EFAULT;
+	}
+
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+	}
+
+	spare = 0;
+	filepa = 0;
+	result = vm_lookup_locked(as, reg, faultaddress, faulttype,
+				  vm_zero_ok(as, reg, faultaddress, faulttype),
+				  &pte, &spare, &filepa);
+	if (result) {
+		if (filepa != 0) {
+			page_free(filepa);
+		}
+		if (spare != 0) {
+			page_free(spare);
+		}
+		return result;
+	}
+
+	if (*pte == 0 && filepa != 0) {
+		/* First touch of a mapped file page. */
+		*pte = filepa | PTE_VALID;
+		filepa = 0;
+		if (reg->ar_perm & AR_SHARED) {
+			*pte |= PTE_SHARED;
+			if (faulttype != VM_FAULT_READ) {
+				vm_shared_write(reg, faultaddress, pte);
+			}
+		}
+		else if (reg->ar_perm & AR_WRITE) {
+			*pte |= PTE_COW;
+			if (faulttype != VM_FAULT_READ) {
+				vm_cow_break(as, faultaddress, pte, &spare);
+			}
+		}
+	}
+	else if (*pte & PTE_VALID) {
+		if (faulttype != VM_FAULT_READ && (*pte & PTE_SHARED)) {
+			vm_shared_write(reg, faultaddress, pte);
+		}
+		if (faulttype == VM_FAULT_READONLY) {
+			if (!(*pte & (PTE_COW | PTE_WRITE))) {
+				/* A genuine write to read-only memory. */
+				lock_release(as->as_lock);
+				if (spare != 0) {
+					page_free(spare);
+				}
+				return EFAULT;
+			}
+		}
+		else {
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+		}
+
+		/* Don't take a second fault just to break the share. */
+		if (faulttype != VM_FAULT_READ && (*pte & PTE_COW)) {
+			vm_cow_break(as, faultaddress, pte, &spare);
+		}
+		else {
+			page_claim(*pte & PTE_FRAME, as, faultaddress);
+		}
+	}
+	else if (*pte & PTE_SWAPPED) {
+		/*
+		 * Paged out (perhaps while a READONLY fault was on its
+		 * way here, in which case it is now just a miss).
+		 */
+		KASSERT(spare != 0);
+		result = vm_swap_in(as, reg, faultaddress, pte, spare);
+		if (result) {
+			lock_release(as->as_lock);
+			page_free(spare);
+			return result;
+		}
+		spare = 0;
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	}
+	else if (spare == 0) {
+		/* A read of a page that would be all zeroes. */
+		*pte = vm_zeropage | PTE_VALID;
+		if (reg->ar_perm & AR_WRITE) {
+			*pte |= PTE_COW;
+		}
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+	}
+	else if (vm_exec_in(as, reg, faultaddress, pte, spare, &result)) {
+		/* A whole page of the executable, and maybe more. */
+		if (result) {
+			lock_release(as->as_lock);
+			page_free(spare);
+			return result;
+		}
+		spare = 0;
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	}
+	else {
+		result = vm_read_exec(as, faultaddress, spare, &didread);
+		if (result) {
+			lock_release(as->as_lock);
+			page_free(spare);
+			return result;
+		}
+		*pte = spare | PTE_VALID;
+		spare = 0;
+		if (reg->ar_perm & AR_WRITE) {
+			*pte |= PTE_WRITE;
+		}
+		if (didread) {
+			vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		}
+		else {
+			vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		}
+	}
+
+	pa = *pte & PTE_FRAME;
+	page_touch(pa);
+
+	elo = *pte & PTE_TLBMASK;
+	/* The loader has to be able to fill in read-only segments. */
+	if (!as->loadelf_finish && !(*pte & PTE_COW)) {
+		elo |= TLBLO_DIRTY;
+	}
+
+#if OPT_TLBPREFETCH
+	if (faulttype != VM_FAULT_READONLY && as->loadelf_finish) {
+		npre = vm_prefetch_collect(as, faultaddress,
+					   prevaddrs, preelos);
+	}
+#endif
+
+	/*
+	 * Load the translations before letting go of the address space:
+	 * once we do, pageout may take the frames, and its shootdown
+	 * only reaches entries that are already in the TLB.
+	 */
+	spl = splhigh();
+#if OPT_TLBPREFETCH
+	/* The faulting page goes in last, as the most recently used. */
+	vm_tlb_prefetch(prevaddrs, preelos, npre);
+#endif
+	i = -1;
+	if (faulttype == VM_FAULT_READONLY) {
+		/* Rewrite the read-only entry in place. */
+		i = tlb_probe(vm_tlb_ehi(faultaddress), 0);
+		if (i >= 0) {
+			tlb_write(vm_tlb_ehi(faultaddress), elo, i);
+			vm_tlb_touch(i);
+		}
+	}
+	if (i < 0) {
+		vm_tlb_load(faultaddress, elo);
+	}
+	splx(spl);
+
+	lock_release(as->as_lock);
+
+	if (spare != 0) {
+		/* Somebody else's fault got there first. */
+		page_free(spare);
+	}
+	if (filepa != 0) {
+		page_free(filepa);
+	}
+
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, pa);
+	return 0;
+}
+
+void
+vm_tlbshootdown_wait(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+	struct cpu *c;
+	unsigned i, n;
+	int spl;
+
+	ts.ts_addrspace = as;
+	ts.ts_vaddr = vaddr;
+	ts.ts_done = vm_shootdown_sem;
+
+	lock_acquire(vm_shootdown_lock);
+
+	/* Stay on this cpu while deciding which ones are "others". */
+	spl = splhigh();
+	n = 0;
+	for (i = 0; i < cpu_count(); i++) {
+		c = cpu_get(i);
+		if (c != curcpu) {
+			ipi_tlbshootdown(c, &ts);
+			n++;
+		}
+	}
+	/* Entries for AS outlive switching away from it, so always look. */
+	vm_tlb_invalidate(as, vaddr);
+	splx(spl);
+
+	while (n-- > 0) {
+		P(vm_shootdown_sem);
+	}
+
+	lock_release(vm_shootdown_lock);
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	vm_tlb_flush();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	int spl;
+
+	/* Whether or not AS is running here; its entries may be. */
+	spl = splhigh();
+	vm_tlb_invalidate(ts->ts_addrspace, ts->ts_vaddr);
+	splx(spl);
+
+	if (ts->ts_done != NULL) {
+		V(ts->ts_done);
+	}
+}